@@ -0,0 +1,615 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010,2011 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark da API de fs.h: leitura e escrita sequenciais com vários
+ * tamanhos de buffer, criação e remoção em massa, muitos arquivos
+ * pequenos, preenchimento do disco e leituras aleatórias. Para cada
+ * carga mostra a vazão e as latências p50/p99/p999 das operações, em
+ * texto ou em JSON (-j).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "lz.h"
+
+#define MAX_BUFFER (1024 * 1024)
+#define STORM 128 /*  Entradas do diretório */
+#define STORM_ROUNDS 8
+#define SMALL_FILES 100
+#define RANDOM_READS 20000
+#define MOUNTS 100
+#define BIG_DIR 4096 /*  Entradas do subdiretório de big_dir */
+#define DIR_LOOKUPS 20000
+#define COPIES 20
+#define ZBUFFER 65536 /*  Escritas e leituras de compressed */
+#define BIG_IMAGE 3072 /*  MB da imagem de big_image, acima de 2 GB */
+
+typedef struct {
+  double *lat; /*  Latência de cada operação, em segundos */
+  int n, cap;
+  long long bytes;
+  double start, elapsed;
+} sample;
+
+int json, first = 1, errors, cluster_size = 4096;
+/*  Os arquivos são escritos com um padrão que depende da posição e se
+ *  repete a cada MAX_BUFFER bytes: o byte da posição off de um arquivo é
+ *  payload[off % MAX_BUFFER]. O dobro permite escrever até MAX_BUFFER
+ *  bytes a partir de qualquer posição. As leituras vão para back. */
+char payload[2 * MAX_BUFFER], back[MAX_BUFFER];
+
+double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void begin(sample *s) {
+  s->n = 0;
+  s->bytes = 0;
+  s->start = now();
+}
+
+void record(sample *s, double t0, int bytes) {
+  if (s->n == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    if ((s->lat = realloc(s->lat, s->cap * sizeof(double))) == NULL) {
+      printf("Memória insuficiente.\n");
+      exit(1);
+    }
+  }
+  s->lat[s->n++] = now() - t0;
+  s->bytes += bytes;
+}
+
+int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*  Preenche payload com o padrão */
+void pattern() {
+  int i;
+
+  for (i = 0; i < 2 * MAX_BUFFER; i++)
+    payload[i] = (char) (i % MAX_BUFFER * 7 + i % MAX_BUFFER / 4093);
+}
+
+/*  Confere n bytes lidos da posição off de um arquivo escrito com
+ *  payload */
+int check(char *buffer, int off, int n) {
+  if (memcmp(buffer, payload + off % MAX_BUFFER, n)) {
+    fprintf(stderr, "Dados lidos diferem dos escritos na posição %d.\n", off);
+    errors++;
+    return 0;
+  }
+  return 1;
+}
+
+/*  Lê o arquivo inteiro e o confere com payload */
+void check_file(char *name, int file_size) {
+  int fd, off, n;
+
+  if ((fd = fs_open(name, FS_R)) == -1) {
+    errors++;
+    return;
+  }
+  for (off = 0; (n = fs_read(back, MAX_BUFFER, fd)) > 0; off += n)
+    if (!check(back, off, n))
+      break;
+  if (n <= 0 && off != file_size) {
+    fprintf(stderr, "%s com %d bytes, %d esperados.\n", name, off, file_size);
+    errors++;
+  }
+  fs_close(fd);
+}
+
+double percentile(sample *s, double p) {
+  int i = (int) (p * s->n);
+
+  if (i >= s->n)
+    i = s->n - 1;
+  return s->lat[i] * 1e6;
+}
+
+void report(char *name, sample *s) {
+  double mbs;
+
+  s->elapsed = now() - s->start;
+  if (!s->n)
+    return;
+  qsort(s->lat, s->n, sizeof(double), cmp_double);
+  mbs = s->bytes / (1024.0 * 1024.0) / s->elapsed;
+
+  if (json) {
+    printf("%s\n  {\"name\": \"%s\", \"ops\": %d, \"seconds\": %.6f, "
+           "\"ops_per_s\": %.1f, \"mb_per_s\": %.2f, \"p50_us\": %.2f, "
+           "\"p99_us\": %.2f, \"p999_us\": %.2f}", first ? "[" : ",", name,
+           s->n, s->elapsed, s->n / s->elapsed, mbs, percentile(s, 0.5),
+           percentile(s, 0.99), percentile(s, 0.999));
+  } else {
+    if (first)
+      printf("%-22s %8s %10s %9s %10s %10s %10s\n", "carga", "ops", "ops/s",
+             "MB/s", "p50 us", "p99 us", "p999 us");
+    printf("%-22s %8d %10.0f %9.2f %10.2f %10.2f %10.2f\n", name, s->n,
+           s->n / s->elapsed, mbs, percentile(s, 0.5), percentile(s, 0.99),
+           percentile(s, 0.999));
+  }
+  first = 0;
+}
+
+void sequential(sample *s, int file_size, int bufsize) {
+  char name[40];
+  double t0;
+  int fd, done, n;
+
+  fs_format_geometry(cluster_size, 0);
+  if ((fd = fs_open("seq", FS_W)) == -1) {
+    errors++;
+    return;
+  }
+  begin(s);
+  for (done = 0; done < file_size; done += n) {
+    n = file_size - done < bufsize ? file_size - done : bufsize;
+    t0 = now();
+    if (fs_write(payload + done % MAX_BUFFER, n, fd) != n) {
+      errors++;
+      break;
+    }
+    record(s, t0, n);
+  }
+  fs_close(fd);
+  sprintf(name, "escrita seq %d B", bufsize);
+  report(name, s);
+
+  if ((fd = fs_open("seq", FS_R)) == -1) {
+    errors++;
+    return;
+  }
+  begin(s);
+  for (done = 0; ; done += n) {
+    t0 = now();
+    if ((n = fs_read(back, bufsize, fd)) <= 0)
+      break;
+    record(s, t0, n);
+    if (!check(back, done, n))
+      break;
+  }
+  fs_close(fd);
+  if (n <= 0 && done != file_size) {
+    fprintf(stderr, "Leitura seq de %d bytes, %d esperados.\n", done, file_size);
+    errors++;
+  }
+  sprintf(name, "leitura seq %d B", bufsize);
+  report(name, s);
+}
+
+void storm(sample *s) {
+  char name[32];
+  double t0;
+  int r, i;
+  sample rm = {0};
+
+  fs_format_geometry(cluster_size, 0);
+  begin(s);
+  begin(&rm);
+  for (r = 0; r < STORM_ROUNDS; r++) {
+    for (i = 0; i < STORM; i++) {
+      sprintf(name, "s%d", i);
+      t0 = now();
+      if (fs_create(name) == -1)
+        errors++;
+      record(s, t0, 0);
+    }
+    for (i = 0; i < STORM; i++) {
+      sprintf(name, "s%d", i);
+      t0 = now();
+      if (fs_remove(name) == -1)
+        errors++;
+      record(&rm, t0, 0);
+    }
+  }
+  report("create", s);
+  report("remove", &rm);
+  free(rm.lat);
+}
+
+void small_files(sample *s) {
+  char name[32];
+  double t0;
+  int i, fd, size;
+  sample rd = {0};
+
+  fs_format_geometry(cluster_size, 0);
+  srand(1);
+  begin(s);
+  for (i = 0; i < SMALL_FILES; i++) {
+    sprintf(name, "p%d", i);
+    size = 1 + rand() % 8192;
+    t0 = now();
+    if ((fd = fs_open(name, FS_W)) == -1 || fs_write(payload, size, fd) != size)
+      errors++;
+    if (fd != -1)
+      fs_close(fd);
+    record(s, t0, size);
+  }
+  report("arquivos pequenos (w)", s);
+
+  begin(&rd);
+  for (i = 0; i < SMALL_FILES; i++) {
+    sprintf(name, "p%d", i);
+    t0 = now();
+    if ((fd = fs_open(name, FS_R)) == -1) {
+      errors++;
+      continue;
+    }
+    size = fs_read(back, MAX_BUFFER, fd);
+    fs_close(fd);
+    record(&rd, t0, size);
+    if (size > 0)
+      check(back, 0, size);
+  }
+  report("arquivos pequenos (r)", &rd);
+  free(rd.lat);
+}
+
+void fill(sample *s) {
+  double t0;
+  int fd, n, chunk = 64 * 1024;
+
+  fs_format_geometry(cluster_size, 0);
+  if ((fd = fs_open("fill", FS_W)) == -1) {
+    errors++;
+    return;
+  }
+  begin(s);
+  do {
+    n = chunk < fs_free() ? chunk : fs_free();
+    t0 = now();
+    if (fs_write(payload, n, fd) != n)
+      errors++;
+    record(s, t0, n);
+  } while (n == chunk);
+  fs_close(fd);
+  report("preenchimento 64 KB", s);
+}
+
+void random_reads(sample *s, int file_size) {
+  double t0;
+  int fd, i, n, off;
+
+  fs_format_geometry(cluster_size, 0);
+  if ((fd = fs_open("rnd", FS_W)) == -1) {
+    errors++;
+    return;
+  }
+  for (off = 0; off < file_size; off += n) {
+    n = file_size - off < MAX_BUFFER ? file_size - off : MAX_BUFFER;
+    fs_write(payload, n, fd);
+  }
+  fs_close(fd);
+
+  if ((fd = fs_open("rnd", FS_R)) == -1) {
+    errors++;
+    return;
+  }
+  srand(2);
+  begin(s);
+  for (i = 0; i < RANDOM_READS; i++) {
+    off = (int) ((double) rand() / RAND_MAX * (file_size - 4096));
+    t0 = now();
+    if ((n = fs_pread(back, 4096, off, fd)) != 4096)
+      errors++;
+    record(s, t0, n);
+    if (n > 0)
+      check(back, off, n);
+  }
+  fs_close(fd);
+  report("leitura aleatória 4 KB", s);
+}
+
+/*  Um subdiretório de BIG_DIR arquivos, criados em um lote, e aberturas
+ *  ao acaso nele */
+void big_dir(sample *s) {
+  char name[32];
+  double t0;
+  int i, fd, n;
+  sample op = {0};
+
+  fs_format_geometry(cluster_size, 0);
+  n = fs_free() / cluster_size / 2 < BIG_DIR ? fs_free() / cluster_size / 2 : BIG_DIR;
+  if (!fs_mkdir("grande")) {
+    errors++;
+    return;
+  }
+  srand(1);
+  begin(s);
+  fs_batch(1);
+  for (i = 0; i < n; i++) {
+    sprintf(name, "grande/g%d", rand());
+    t0 = now();
+    if (fs_create(name) == -1)
+      i--; /*  Nome repetido */
+    record(s, t0, 0);
+  }
+  fs_batch(0);
+  report("create em subdiretório", s);
+
+  srand(1);
+  begin(&op);
+  for (i = 0; i < DIR_LOOKUPS; i++) {
+    if (i % n == 0)
+      srand(1);
+    sprintf(name, "grande/g%d", rand());
+    t0 = now();
+    if ((fd = fs_open(name, FS_R)) == -1)
+      errors++;
+    else
+      fs_close(fd);
+    record(&op, t0, 0);
+  }
+  report("open em subdiretório", &op);
+  free(op.lat);
+}
+
+/*  Cópias e clones de um arquivo de file_size bytes, cada um sobre o
+ *  anterior */
+void copies(sample *s, int file_size) {
+  double t0;
+  int fd, i, n, off;
+  sample op = {0};
+
+  fs_format_geometry(cluster_size, 0);
+  if ((fd = fs_open("orig", FS_W)) == -1) {
+    errors++;
+    return;
+  }
+  for (off = 0; off < file_size; off += n) {
+    n = file_size - off < MAX_BUFFER ? file_size - off : MAX_BUFFER;
+    fs_write(payload, n, fd);
+  }
+  fs_close(fd);
+
+  begin(s);
+  for (i = 0; i < COPIES; i++) {
+    t0 = now();
+    if (!fs_copy("orig", "copia"))
+      errors++;
+    record(s, t0, file_size);
+  }
+  report("copy", s);
+
+  begin(&op);
+  for (i = 0; i < COPIES; i++) {
+    t0 = now();
+    if (!fs_clone("orig", "clone"))
+      errors++;
+    record(&op, t0, file_size);
+  }
+  report("clone", &op);
+  free(op.lat);
+  check_file("orig", file_size);
+  check_file("copia", file_size);
+  check_file("clone", file_size);
+}
+
+/*  Escrita e leitura sequenciais de um log em texto, em uma imagem com
+ *  compressão. É a primeira formatação da imagem: ligada com uma imagem
+ *  já formatada sem ela, a compressão só avisa que fica para a próxima.
+ *  Deixa o texto no lugar do padrão e a imagem montada. */
+void compressed(sample *s, int file_size) {
+  double t0;
+  int fd, done, n;
+
+  for (done = 0; done < MAX_BUFFER; done += n)
+    n = snprintf(payload + done, MAX_BUFFER - done,
+                 "2026-10-17 12:%02d:%02d INFO req=%d path=/api/v1/items/%d status=200 ms=%d\n",
+                 done / 60 % 60, done % 60, done, rand() % 500, rand() % 90);
+  if (cluster_size > LZ_MAXBLOCK) /*  Sem compressão nesta geometria */
+    return;
+  fs_compression(1);
+  if (!fs_format_geometry(cluster_size, 0) || !fs_init() ||
+      (fd = fs_open("log", FS_W)) == -1) {
+    errors++;
+    fs_compression(0);
+    return;
+  }
+  begin(s);
+  for (done = 0; done < file_size; done += n) {
+    n = file_size - done < ZBUFFER ? file_size - done : ZBUFFER;
+    t0 = now();
+    if (fs_write(payload + done % MAX_BUFFER, n, fd) != n) {
+      errors++;
+      break;
+    }
+    record(s, t0, n);
+  }
+  fs_close(fd);
+  report("escrita comprimida", s);
+
+  if ((fd = fs_open("log", FS_R)) == -1) {
+    errors++;
+    fs_compression(0);
+    return;
+  }
+  begin(s);
+  for (done = 0; ; done += n) {
+    t0 = now();
+    if ((n = fs_read(back, ZBUFFER, fd)) <= 0)
+      break;
+    record(s, t0, n);
+    if (!check(back, done, n))
+      break;
+  }
+  fs_close(fd);
+  if (n <= 0 && done != file_size) {
+    fprintf(stderr, "Leitura comprimida de %d bytes, %d esperados.\n", done, file_size);
+    errors++;
+  }
+  report("leitura comprimida", s);
+  fs_compression(0);
+}
+
+/*  Montagens seguidas da imagem depois de uma desmontagem limpa, como as
+ *  de processos curtos */
+void mounts(sample *s, char *image, int mode) {
+  rsfs_t *fs;
+  double t0;
+  int i;
+
+  if (!fs_unmount()) {
+    errors++;
+    return;
+  }
+  begin(s);
+  for (i = 0; i < MOUNTS; i++) {
+    t0 = now();
+    if ((fs = rsfs_mount_mode(image, 0, mode)) == NULL) {
+      errors++;
+      return;
+    }
+    record(s, t0, 0);
+    rsfs_unmount(fs);
+  }
+  report("montagem limpa", s);
+}
+
+/*  Formata uma imagem esparsa de BIG_IMAGE MB e confere, depois de
+ *  remontá-la, um arquivo e o último setor, além dos 2 GB. Deixa montada
+ *  no lugar da imagem principal. */
+void big_image(sample *s, char *image, int mode) {
+  char path[256], sector[SECTORSIZE];
+  double t0;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s.grande", image);
+  unlink(path);
+  begin(s);
+  t0 = now();
+  if (!bl_init_mode(path, BIG_IMAGE * 2048LL, mode) ||
+      !fs_format_geometry(cluster_size, 0) || !fs_init()) {
+    errors++;
+    unlink(path);
+    return;
+  }
+  record(s, t0, 0);
+  report("formatação 3 GB", s);
+
+  memset(sector, 'g', SECTORSIZE);
+  if ((fd = fs_open("g", FS_W)) == -1 || fs_write(payload, MAX_BUFFER, fd) != MAX_BUFFER ||
+      fs_close(fd) == -1 || !bl_write(bl_size() - 1, sector)) {
+    errors++;
+    unlink(path);
+    return;
+  }
+  fs_unmount();
+  memset(sector, 0, SECTORSIZE);
+  fd = -1;
+  if (!fs_init() || (fd = fs_open("g", FS_R)) == -1 ||
+      fs_read(back, MAX_BUFFER / 2, fd) != MAX_BUFFER / 2 ||
+      memcmp(back, payload, MAX_BUFFER / 2) ||
+      !bl_read(bl_size() - 1, sector) || sector[0] != 'g' || sector[SECTORSIZE - 1] != 'g') {
+    fprintf(stderr, "Imagem de %d MB lida de volta com erro.\n", BIG_IMAGE);
+    errors++;
+  }
+  if (fd != -1)
+    fs_close(fd);
+  unlink(path);
+}
+
+int main(int argc, char **argv) {
+  char *image = "/tmp/rsfs-bench.img";
+  int mb = 64, sizes[] = {10, 512, 4096, 65536, MAX_BUFFER}, i, mode;
+  char *backend, *sync;
+  sample s = {0};
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-j")) {
+      json = 1;
+    } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      cluster_size = atoi(argv[++i]);
+    } else {
+      break;
+    }
+  }
+  if (i < argc)
+    mb = atoi(argv[i++]);
+  if (i < argc)
+    image = argv[i++];
+  if (mb < 4 || i < argc) {
+    printf("Uso: %s [-j] [-c tamanho do agrupamento] [tamanho da imagem em MB] [imagem]\n", argv[0]);
+    exit(0);
+  }
+
+  mode = BL_PREAD;
+  backend = getenv("RSFS_BACKEND");
+  if (backend != NULL && !strcmp(backend, "mmap")) {
+    mode = BL_MMAP;
+  } else if (backend != NULL && !strcmp(backend, "uring")) {
+    mode = BL_URING;
+  }
+  sync = getenv("RSFS_SYNC");
+  if (sync != NULL && !strcmp(sync, "none")) {
+    fs_durability(FS_SYNC_NONE);
+  } else if (sync != NULL && !strcmp(sync, "write")) {
+    fs_durability(FS_SYNC_WRITE);
+  }
+
+  unlink(image);
+  if (!bl_init_mode(image, mb * 2048LL, mode))
+    exit(1);
+  compressed(&s, mb / 4 * 1024 * 1024);
+  /*  Formatada antes de fs_init, que a encontra pronta */
+  if (!fs_format_geometry(cluster_size, 0) || !fs_init())
+    exit(1);
+  pattern();
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    sequential(&s, mb / 4 * 1024 * 1024, sizes[i]);
+  storm(&s);
+  small_files(&s);
+  fill(&s);
+  random_reads(&s, mb / 4 * 1024 * 1024);
+  big_dir(&s);
+  copies(&s, mb / 4 * 1024 * 1024);
+  mounts(&s, image, mode);
+  big_image(&s, image, mode);
+
+  if (json)
+    printf("\n]\n");
+  free(s.lat);
+  unlink(image);
+  if (errors) {
+    fprintf(stderr, "%d erros.\n", errors);
+    return 1;
+  }
+  return 0;
+}
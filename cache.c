@@ -0,0 +1,240 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+/*  Cache LRU de agrupamentos: tabela hash encadeada sobre as posições e
+ *  lista duplamente ligada da mais recente (head) à menos recente (tail) */
+
+typedef struct {
+  int cluster;
+  int prev, next;     /*  Lista LRU */
+  int hnext;          /*  Encadeamento no balde */
+} slot;
+
+struct cache_t {
+  slot *slots;
+  int *buckets;
+  char *data;
+  int nslots, nbuckets, csize, used;
+  int head, tail;
+  cache_stats stats;
+  pthread_mutex_t lock;
+};
+
+int bucket_of(cache_t *c, int cluster) {
+  return (cluster * 2654435761u) & (c->nbuckets - 1);
+}
+
+int cache_setup(cache_t *c, int nclusters, int cluster_size) {
+  int i;
+
+  free(c->slots);
+  free(c->buckets);
+  free(c->data);
+  c->slots = NULL;
+  c->buckets = NULL;
+  c->data = NULL;
+  c->nslots = 0;
+  c->used = 0;
+  c->head = c->tail = -1;
+  memset(&c->stats, 0, sizeof(c->stats));
+
+  if (nclusters <= 0)
+    return 1;
+
+  for (c->nbuckets = 1; c->nbuckets < 2 * nclusters; c->nbuckets *= 2);
+  c->slots = malloc(nclusters * sizeof(slot));
+  c->buckets = malloc(c->nbuckets * sizeof(int));
+  c->data = malloc((size_t) nclusters * cluster_size);
+  if (c->slots == NULL || c->buckets == NULL || c->data == NULL) {
+    printf("Memória insuficiente para a cache.\n");
+    cache_setup(c, 0, cluster_size);
+    return 0;
+  }
+  for (i = 0; i < c->nbuckets; c->buckets[i++] = -1);
+  c->nslots = nclusters;
+  c->csize = cluster_size;
+  return 1;
+}
+
+/*  Cache vazia, dimensionada depois por cache_init */
+cache_t *cache_new() {
+  cache_t *c;
+
+  if ((c = calloc(1, sizeof(cache_t))) == NULL) {
+    printf("Memória insuficiente para a cache.\n");
+    return NULL;
+  }
+  c->head = c->tail = -1;
+  pthread_mutex_init(&c->lock, NULL);
+  return c;
+}
+
+void cache_free(cache_t *c) {
+  if (c == NULL)
+    return;
+  cache_setup(c, 0, 0);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+int cache_init(cache_t *c, int nclusters, int cluster_size) {
+  int ok;
+
+  pthread_mutex_lock(&c->lock);
+  ok = cache_setup(c, nclusters, cluster_size);
+  pthread_mutex_unlock(&c->lock);
+  return ok;
+}
+
+int lookup(cache_t *c, int cluster) {
+  int i;
+
+  for (i = c->buckets[bucket_of(c, cluster)];
+       i != -1 && c->slots[i].cluster != cluster; i = c->slots[i].hnext);
+  return i;
+}
+
+void lru_unlink(cache_t *c, int i) {
+  if (c->slots[i].prev != -1)
+    c->slots[c->slots[i].prev].next = c->slots[i].next;
+  else
+    c->head = c->slots[i].next;
+  if (c->slots[i].next != -1)
+    c->slots[c->slots[i].next].prev = c->slots[i].prev;
+  else
+    c->tail = c->slots[i].prev;
+}
+
+void lru_push(cache_t *c, int i) {
+  c->slots[i].prev = -1;
+  c->slots[i].next = c->head;
+  if (c->head != -1)
+    c->slots[c->head].prev = i;
+  c->head = i;
+  if (c->tail == -1)
+    c->tail = i;
+}
+
+void hash_unlink(cache_t *c, int i) {
+  int *p;
+
+  for (p = &c->buckets[bucket_of(c, c->slots[i].cluster)]; *p != i;
+       p = &c->slots[*p].hnext);
+  *p = c->slots[i].hnext;
+}
+
+int cache_get(cache_t *c, int cluster, char *buffer) {
+  int i;
+
+  pthread_mutex_lock(&c->lock);
+  if (!c->nslots) {
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+  }
+  i = lookup(c, cluster);
+  if (i == -1) {
+    c->stats.misses++;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+  }
+  c->stats.hits++;
+  if (i != c->head) {
+    lru_unlink(c, i);
+    lru_push(c, i);
+  }
+  memcpy(buffer, c->data + (size_t) i * c->csize, c->csize);
+  pthread_mutex_unlock(&c->lock);
+  return 1;
+}
+
+void cache_put(cache_t *c, int cluster, char *buffer) {
+  int i, b;
+
+  pthread_mutex_lock(&c->lock);
+  if (!c->nslots) {
+    pthread_mutex_unlock(&c->lock);
+    return;
+  }
+  i = lookup(c, cluster);
+  if (i != -1) {
+    lru_unlink(c, i);
+  } else {
+    if (c->used < c->nslots) {
+      i = c->used++;
+    } else { /*  Substitui o menos recentemente usado */
+      i = c->tail;
+      lru_unlink(c, i);
+      if (c->slots[i].cluster != -1) {
+        hash_unlink(c, i);
+        c->stats.evictions++;
+      }
+    }
+    c->slots[i].cluster = cluster;
+    b = bucket_of(c, cluster);
+    c->slots[i].hnext = c->buckets[b];
+    c->buckets[b] = i;
+  }
+  lru_push(c, i);
+  memcpy(c->data + (size_t) i * c->csize, buffer, c->csize);
+  pthread_mutex_unlock(&c->lock);
+}
+
+void cache_invalidate(cache_t *c, int cluster) {
+  int i;
+
+  pthread_mutex_lock(&c->lock);
+  if (!c->nslots || (i = lookup(c, cluster)) == -1) {
+    pthread_mutex_unlock(&c->lock);
+    return;
+  }
+  lru_unlink(c, i);
+  hash_unlink(c, i);
+  /*  A posição livre vai para o fim da lista e é a próxima a ser reusada */
+  c->slots[i].cluster = -1;
+  c->slots[i].next = -1;
+  c->slots[i].prev = c->tail;
+  if (c->tail != -1)
+    c->slots[c->tail].next = i;
+  else
+    c->head = i;
+  c->tail = i;
+  pthread_mutex_unlock(&c->lock);
+}
+
+void cache_get_stats(cache_t *c, cache_stats *st) {
+  pthread_mutex_lock(&c->lock);
+  *st = c->stats;
+  pthread_mutex_unlock(&c->lock);
+}
+
+void cache_reset_stats(cache_t *c) {
+  pthread_mutex_lock(&c->lock);
+  memset(&c->stats, 0, sizeof(c->stats));
+  pthread_mutex_unlock(&c->lock);
+}
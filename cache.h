@@ -0,0 +1,38 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} cache_stats;
+
+typedef struct cache_t cache_t;
+
+cache_t *cache_new();
+void cache_free(cache_t *c);
+int cache_init(cache_t *c, int nclusters, int cluster_size);
+int cache_get(cache_t *c, int cluster, char *buffer);
+void cache_put(cache_t *c, int cluster, char *buffer);
+void cache_invalidate(cache_t *c, int cluster);
+void cache_get_stats(cache_t *c, cache_stats *stats);
+void cache_reset_stats(cache_t *c);
@@ -20,77 +20,589 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
 #include "disk.h"
 
 #define PAGESIZE 4096
+#define MAXIOV 64
+#define QUEUEDEPTH 64
+
+struct bl_device {
+  off_t device_size; /*  Em bytes */
+  int fd;
+  char *map;
+  int use_uring;
+  /*  Contadores, atualizados atomicamente por todas as threads */
+  bl_stats stats;
+  int next_sector; /*  Setor seguinte à última requisição */
+};
+
+/*  Dispositivo da interface bl_* sem handle */
+static bl_device *default_device;
+
+/*  Requisições enfileiradas por bl_submit_read/bl_submit_write. Cada
+ *  thread tem a sua fila, que pode misturar dispositivos, e, com io_uring,
+ *  o seu anel. */
+typedef struct {
+  bl_device *dev;
+  char write;
+  int sector;
+  int count;
+  char *buffer;
+} request;
+
+static __thread request queue[QUEUEDEPTH];
+static __thread int queued;
+static __thread int queue_error;
 
-int device_size;
-FILE *stream;
+#ifdef HAVE_IO_URING
+typedef struct {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  char *sq, *cq;
+  size_t sq_size, cq_size, sqes_size;
+} uring;
 
-int bl_init(char *file, int size) {
+/*  fd é -1 antes da primeira tentativa e -2 se io_uring_setup falhou
+ *  nesta thread, que então fica no caminho pread */
+static __thread uring ring = { -1 };
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+int uring_ready();
+int uring_flush();
+#endif
+
+/*  Abre a imagem file; se ela não existe, cria uma com size setores */
+bl_device *bl_dev_open(char *file, long long size, int mode) {
   struct stat sb;
+  bl_device *d;
 
-  stream = NULL;
+  if ((d = calloc(1, sizeof(bl_device))) == NULL) {
+    printf("Memória insuficiente para o dispositivo.\n");
+    return NULL;
+  }
+  d->fd = -1;
   if (stat(file, &sb) == 0) {
     if (S_ISREG(sb.st_mode)) {
-      device_size = sb.st_size;
-      stream = fopen(file, "r+");
+      d->device_size = sb.st_size;
+      d->fd = open(file, O_RDWR);
     }
-    if (stream == NULL) {
+    if (d->fd == -1) {
       perror("Abrindo imagem pré-existente");
-      return 0;
+      goto fail;
     }
   } else {
-    device_size = size * SECTORSIZE;
-    if (device_size < 1) {
+    d->device_size = (off_t) size * SECTORSIZE;
+    if (d->device_size < 1) {
       printf("Imagem não pode ter tamanho zero\n");
-      return 0;
+      goto fail;
     }
-    stream = fopen(file, "w+");
-    if (stream == NULL) {
+    d->fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (d->fd == -1) {
       perror("Criando nova imagem");
-      return 0;
+      goto fail;
     }
-    if (truncate(file, device_size) == -1) {
+    if (ftruncate(d->fd, d->device_size) == -1) {
       perror("Ajustando tamanho da imagem");
-      return 0;
+      goto fail;
     }
   }
+
+  if (mode == BL_MMAP) {
+    if (d->device_size < 1) {
+      printf("Imagem não pode ter tamanho zero\n");
+      goto fail;
+    }
+    d->map = mmap(NULL, d->device_size, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+    if (d->map == MAP_FAILED) {
+      d->map = NULL;
+      perror("Mapeando imagem em memória");
+      goto fail;
+    }
+  }
+#ifdef HAVE_IO_URING
+  /*  Sem io_uring no kernel, as requisições seguem pelo caminho pread */
+  d->use_uring = mode == BL_URING && uring_ready();
+#endif
+  return d;
+
+ fail:
+  if (d->fd != -1)
+    close(d->fd);
+  free(d);
+  return NULL;
+}
+
+/*  As requisições enfileiradas para d já devem ter terminado */
+void bl_dev_close(bl_device *d) {
+  if (d == NULL)
+    return;
+  if (d->map != NULL)
+    munmap(d->map, d->device_size);
+  close(d->fd);
+  free(d);
+}
+
+int bl_init(char *file, long long size) {
+  return bl_init_mode(file, size, BL_PREAD);
+}
+
+int bl_init_mode(char *file, long long size, int mode) {
+  bl_device *d;
+
+  queued = 0;
+  queue_error = 0;
+  if ((d = bl_dev_open(file, size, mode)) == NULL)
+    return 0;
+  bl_dev_close(default_device);
+  default_device = d;
   return 1; 
 }
 
-int bl_size() {
-  return device_size / SECTORSIZE;
+bl_device *bl_default() {
+  return default_device;
 }
 
-int bl_write(int sector, char *buffer) {
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Erro posicionando setor para escrita");
+long long bl_dev_size(bl_device *d) {
+  return d->device_size / SECTORSIZE;
+}
+
+long long bl_size() {
+  return bl_dev_size(default_device);
+}
+
+int bl_dev_sync(bl_device *d) {
+  __atomic_add_fetch(&d->stats.syncs, 1, __ATOMIC_RELAXED);
+  if (d->map != NULL) {
+    if (msync(d->map, d->device_size, MS_SYNC) == -1) {
+      perror("Sincronizando imagem mapeada");
+      return 0;
+    }
+  } else if (fdatasync(d->fd) == -1) {
+    perror("Sincronizando imagem");
+    return 0;
+  }
+  return 1;
+}
+
+int bl_sync() {
+  return bl_dev_sync(default_device);
+}
+
+void count_io(bl_device *d, int write, int sector, int count) {
+  if (write)
+    __atomic_add_fetch(&d->stats.sectors_written, count, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&d->stats.sectors_read, count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&d->stats.requests, 1, __ATOMIC_RELAXED);
+  if (__atomic_exchange_n(&d->next_sector, sector + count, __ATOMIC_RELAXED) != sector)
+    __atomic_add_fetch(&d->stats.seeks, 1, __ATOMIC_RELAXED);
+}
+
+int iov_sectors(const struct iovec *iov, int iovcnt) {
+  off_t len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  return len / SECTORSIZE;
+}
+
+void bl_dev_get_stats(bl_device *d, bl_stats *s) {
+  s->sectors_read = __atomic_load_n(&d->stats.sectors_read, __ATOMIC_RELAXED);
+  s->sectors_written = __atomic_load_n(&d->stats.sectors_written, __ATOMIC_RELAXED);
+  s->requests = __atomic_load_n(&d->stats.requests, __ATOMIC_RELAXED);
+  s->seeks = __atomic_load_n(&d->stats.seeks, __ATOMIC_RELAXED);
+  s->syncs = __atomic_load_n(&d->stats.syncs, __ATOMIC_RELAXED);
+}
+
+void bl_dev_reset_stats(bl_device *d) {
+  __atomic_store_n(&d->stats.sectors_read, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->stats.sectors_written, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->stats.requests, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->stats.seeks, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->stats.syncs, 0, __ATOMIC_RELAXED);
+}
+
+void bl_get_stats(bl_stats *s) {
+  bl_dev_get_stats(default_device, s);
+}
+
+void bl_reset_stats() {
+  bl_dev_reset_stats(default_device);
+}
+
+/*  Cópia de/para a imagem mapeada em memória */
+int map_transfer(bl_device *d, int write, off_t pos, const struct iovec *iov,
+                 int iovcnt) {
+  int i;
+
+  for (i = 0; i < iovcnt; pos += iov[i].iov_len, i++) {
+    if (write)
+      memcpy(d->map + pos, iov[i].iov_base, iov[i].iov_len);
+    else
+      memcpy(iov[i].iov_base, d->map + pos, iov[i].iov_len);
+  }
+  return 1;
+}
+
+/*  Transfere os vetores a partir de sector, repetindo em caso de
+ *  transferência parcial. Retorna 1 em caso de sucesso. */
+int bl_transfer(bl_device *d, int write, int sector, const struct iovec *iov,
+                int iovcnt) {
+  struct iovec v[MAXIOV];
+  off_t pos = (off_t) sector * SECTORSIZE;
+  off_t len = 0;
+  ssize_t n;
+  int i;
+
+  if (iovcnt > MAXIOV) {
+    errno = EINVAL;
     return 0;
   }
-  if (fwrite(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Erro escrevendo setor");
+  for (i = 0; i < iovcnt; i++) {
+    v[i] = iov[i];
+    len += iov[i].iov_len;
+  }
+  if (sector < 0 || pos + len > d->device_size) {
+    errno = EINVAL;
     return 0;
   }
-  if (fflush(stream) != 0) {
-    perror("Erro gravando setor no disco");
+
+  if (d->map != NULL)
+    return map_transfer(d, write, pos, iov, iovcnt);
+
+  i = 0;
+  while (i < iovcnt) {
+    if (write)
+      n = pwritev(d->fd, v + i, iovcnt - i, pos);
+    else
+      n = preadv(d->fd, v + i, iovcnt - i, pos);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == 0)
+        errno = EIO;
+      return 0;
+    }
+    pos += n;
+    while (i < iovcnt && n >= (ssize_t) v[i].iov_len)
+      n -= v[i++].iov_len;
+    if (n) {
+      v[i].iov_base = (char *) v[i].iov_base + n;
+      v[i].iov_len -= n;
+    }
+  }
+  return 1;
+}
+
+int bl_dev_writev(bl_device *d, int sector, const struct iovec *iov, int iovcnt) {
+  count_io(d, 1, sector, iov_sectors(iov, iovcnt));
+  if (!bl_transfer(d, 1, sector, iov, iovcnt)) {
+    perror("Erro escrevendo setores");
     return 0;
   }
   return 1;
 }
 
+int bl_dev_readv(bl_device *d, int sector, const struct iovec *iov, int iovcnt) {
+  count_io(d, 0, sector, iov_sectors(iov, iovcnt));
+  if (!bl_transfer(d, 0, sector, iov, iovcnt)) {
+    perror("Erro lendo setores");
+    return 0;
+  }
+  return 1;
+}
+
+int bl_dev_write_range(bl_device *d, int sector, int count, char *buffer) {
+  struct iovec iov;
+
+  iov.iov_base = buffer;
+  iov.iov_len = count * SECTORSIZE;
+  return bl_dev_writev(d, sector, &iov, 1);
+}
+
+int bl_dev_read_range(bl_device *d, int sector, int count, char *buffer) {
+  struct iovec iov;
+
+  iov.iov_base = buffer;
+  iov.iov_len = count * SECTORSIZE;
+  return bl_dev_readv(d, sector, &iov, 1);
+}
+
+int bl_writev(int sector, const struct iovec *iov, int iovcnt) {
+  return bl_dev_writev(default_device, sector, iov, iovcnt);
+}
+
+int bl_readv(int sector, const struct iovec *iov, int iovcnt) {
+  return bl_dev_readv(default_device, sector, iov, iovcnt);
+}
+
+int bl_write_range(int sector, int count, char *buffer) {
+  return bl_dev_write_range(default_device, sector, count, buffer);
+}
+
+int bl_read_range(int sector, int count, char *buffer) {
+  return bl_dev_read_range(default_device, sector, count, buffer);
+}
+
+int bl_write(int sector, char *buffer) {
+  return bl_write_range(sector, 1, buffer);
+}
+
 int bl_read(int sector, char *buffer){
-  if (fseek(stream, sector * SECTORSIZE, SEEK_SET) == -1) {
-    perror("Erro posicionando setor para leitura");
+  return bl_read_range(sector, 1, buffer);
+}
+
+/*  Interface assíncrona: as requisições são acumuladas e enviadas em lote
+ *  por bl_wait. Os buffers não devem ser tocados até o retorno de bl_wait. */
+
+int bl_submit(bl_device *d, int write, int sector, int count, char *buffer) {
+  struct iovec iov;
+
+  if (sector < 0 || count < 0 || ((off_t) sector + count) * SECTORSIZE > d->device_size) {
+    errno = EINVAL;
+    perror(write ? "Erro escrevendo setores" : "Erro lendo setores");
+    queue_error = 1;
     return 0;
   }
-  if (fread(buffer, sizeof(char), SECTORSIZE, stream) != SECTORSIZE) {
-    perror("Erro lendo setor");
+  count_io(d, write, sector, count);
+
+#ifdef HAVE_IO_URING
+  if (d->use_uring && uring_ready()) {
+    /*  Fila cheia: enviada sem passar por bl_wait, que descartaria um erro
+     *  das requisições anteriores do lote */
+    if (queued == QUEUEDEPTH && !uring_flush())
+      queue_error = 1;
+    queue[queued].dev = d;
+    queue[queued].write = write;
+    queue[queued].sector = sector;
+    queue[queued].count = count;
+    queue[queued].buffer = buffer;
+    queued++;
+    return 1;
+  }
+#endif
+
+  /*  Sem io_uring a requisição é executada imediatamente */
+  iov.iov_base = buffer;
+  iov.iov_len = count * SECTORSIZE;
+  if (!bl_transfer(d, write, sector, &iov, 1)) {
+    perror(write ? "Erro escrevendo setores" : "Erro lendo setores");
+    queue_error = 1;
+  }
+  return 1;
+}
+
+int bl_dev_submit_write(bl_device *d, int sector, int count, char *buffer) {
+  return bl_submit(d, 1, sector, count, buffer);
+}
+
+int bl_dev_submit_read(bl_device *d, int sector, int count, char *buffer) {
+  return bl_submit(d, 0, sector, count, buffer);
+}
+
+int bl_submit_write(int sector, int count, char *buffer) {
+  return bl_submit(default_device, 1, sector, count, buffer);
+}
+
+int bl_submit_read(int sector, int count, char *buffer) {
+  return bl_submit(default_device, 0, sector, count, buffer);
+}
+
+#ifdef HAVE_IO_URING
+/*  Desfaz o anel de uma thread que termina */
+void uring_exit(void *arg) {
+  uring *r = arg;
+
+  munmap(r->sqes, r->sqes_size);
+  if (r->cq != r->sq)
+    munmap(r->cq, r->cq_size);
+  munmap(r->sq, r->sq_size);
+  close(r->fd);
+  r->fd = -1;
+}
+
+void uring_key() {
+  pthread_key_create(&ring_key, uring_exit);
+}
+
+int uring_init() {
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  ring.fd = syscall(__NR_io_uring_setup, QUEUEDEPTH, &p);
+  if (ring.fd == -1) {
+    ring.fd = -2;
     return 0;
   }
+
+  ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP && ring.cq_size > ring.sq_size)
+    ring.sq_size = ring.cq_size;
+
+  ring.sq = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (ring.sq == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring.cq = ring.sq;
+  else {
+    ring.cq = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq == MAP_FAILED)
+      goto fail;
+  }
+  ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED)
+    goto fail;
+
+  ring.sq_head = (unsigned *) (ring.sq + p.sq_off.head);
+  ring.sq_tail = (unsigned *) (ring.sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *) (ring.sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) (ring.sq + p.sq_off.array);
+  ring.cq_head = (unsigned *) (ring.cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *) (ring.cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *) (ring.cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (ring.cq + p.cq_off.cqes);
+
+  pthread_once(&ring_once, uring_key);
+  pthread_setspecific(ring_key, &ring);
   return 1;
+
+ fail:
+  close(ring.fd);
+  ring.fd = -2;
+  return 0;
+}
+
+/*  Anel da thread pronto, criado na primeira chamada */
+int uring_ready() {
+  return ring.fd >= 0 || (ring.fd == -1 && uring_init());
+}
+
+/*  Executa uma requisição da fila pelo caminho síncrono */
+void uring_fallback(request *r) {
+  struct iovec iov;
+
+  iov.iov_base = r->buffer;
+  iov.iov_len = r->count * SECTORSIZE;
+  if (!bl_transfer(r->dev, r->write, r->sector, &iov, 1)) {
+    perror(r->write ? "Erro escrevendo setores" : "Erro lendo setores");
+    queue_error = 1;
+  }
+}
+
+/*  Envia todas as requisições enfileiradas com um único io_uring_enter e
+ *  colhe as conclusões. Transferências parciais são refeitas com pread.
+ *  Se io_uring_enter falha, as requisições que o kernel não consumiu
+ *  seguem por pread e as já enviadas são esperadas, sem enviar mais
+ *  nada: os buffers continuam em uso pelo kernel até elas concluírem. */
+int uring_flush() {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct iovec iov;
+  unsigned tail, head, idx;
+  int i, done, sent, failed, res, len;
+  request *r;
+
+  tail = *ring.sq_tail;
+  for (i = 0; i < queued; i++) {
+    idx = tail & *ring.sq_mask;
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = queue[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = queue[i].dev->fd;
+    sqe->off = (off_t) queue[i].sector * SECTORSIZE;
+    sqe->addr = (unsigned long) queue[i].buffer;
+    sqe->len = queue[i].count * SECTORSIZE;
+    sqe->user_data = i;
+    ring.sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+  done = 0;
+  sent = queued;
+  failed = 0;
+  while (done < sent) {
+    /*  Depois de uma falha, nada resta para enviar e a chamada só espera
+     *  as conclusões; se ela falha de novo, é repetida */
+    res = syscall(__NR_io_uring_enter, ring.fd,
+                  tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE),
+                  sent - done, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (res == -1 && errno != EINTR && !failed) {
+      perror("Erro enviando requisições ao io_uring");
+      failed = 1;
+      /*  As entradas ainda não consumidas saem do anel; o kernel as
+       *  consome em ordem, então são as últimas da fila */
+      sent -= tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+      tail = *ring.sq_head;
+      __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+      for (i = sent; i < queued; i++)
+        uring_fallback(&queue[i]);
+    }
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring.cqes[head & *ring.cq_mask];
+      r = &queue[cqe->user_data];
+      res = cqe->res;
+      len = r->count * SECTORSIZE;
+      if (res >= 0 && res < len) { /*  Refeita de forma síncrona */
+        iov.iov_base = r->buffer;
+        iov.iov_len = len;
+        res = bl_transfer(r->dev, r->write, r->sector, &iov, 1) ? len : -errno;
+      }
+      if (res < 0) {
+        errno = -res;
+        perror(r->write ? "Erro escrevendo setores" : "Erro lendo setores");
+        queue_error = 1;
+      }
+      head++;
+      done++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  queued = 0;
+  return !failed;
+}
+#endif
+
+int bl_wait() {
+  int ok;
+
+#ifdef HAVE_IO_URING
+  if (queued && !uring_flush())
+    queue_error = 1;
+#endif
+  queued = 0;
+  ok = !queue_error;
+  queue_error = 0;
+  return ok;
 }
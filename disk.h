@@ -20,9 +20,53 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/uio.h>
+
 #define SECTORSIZE 512
 
-int bl_init(char *file, int size);
-int bl_size();
+#define BL_PREAD 0
+#define BL_MMAP 1
+#define BL_URING 2
+
+typedef struct {
+  unsigned long long sectors_read;
+  unsigned long long sectors_written;
+  unsigned long long requests;
+  unsigned long long seeks; /*  Requisições que não continuam a anterior */
+  unsigned long long syncs;
+} bl_stats;
+
+typedef struct bl_device bl_device;
+
+/*  Interface com handle: vários dispositivos abertos no mesmo processo.
+ *  bl_wait vale para as requisições da thread em todos eles. */
+bl_device *bl_dev_open(char *file, long long size, int mode);
+void bl_dev_close(bl_device *d);
+int bl_dev_sync(bl_device *d);
+long long bl_dev_size(bl_device *d);
+int bl_dev_write_range(bl_device *d, int sector, int count, char *buffer);
+int bl_dev_read_range(bl_device *d, int sector, int count, char *buffer);
+int bl_dev_writev(bl_device *d, int sector, const struct iovec *iov, int iovcnt);
+int bl_dev_readv(bl_device *d, int sector, const struct iovec *iov, int iovcnt);
+int bl_dev_submit_write(bl_device *d, int sector, int count, char *buffer);
+int bl_dev_submit_read(bl_device *d, int sector, int count, char *buffer);
+void bl_dev_get_stats(bl_device *d, bl_stats *stats);
+void bl_dev_reset_stats(bl_device *d);
+
+/*  Interface original, sobre o dispositivo aberto por bl_init */
+int bl_init(char *file, long long size);
+int bl_init_mode(char *file, long long size, int mode);
+bl_device *bl_default();
+int bl_sync();
+long long bl_size();
 int bl_write(int sector, char* buffer);
 int bl_read(int sector, char* buffer);
+int bl_write_range(int sector, int count, char *buffer);
+int bl_read_range(int sector, int count, char *buffer);
+int bl_writev(int sector, const struct iovec *iov, int iovcnt);
+int bl_readv(int sector, const struct iovec *iov, int iovcnt);
+int bl_submit_write(int sector, int count, char *buffer);
+int bl_submit_read(int sector, int count, char *buffer);
+int bl_wait();
+void bl_get_stats(bl_stats *stats);
+void bl_reset_stats();
@@ -20,451 +20,3588 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
-
-#define CLUSTERSIZE 4096
-#define FATSIZE 65536
-#define DIRSIZE 128
-
-#define NSECTORSFAT 2 * FATSIZE / SECTORSIZE
-#define NSECTORSDIR CLUSTERSIZE / SECTORSIZE
-#define NCLUSTERSFAT 2 * FATSIZE / CLUSTERSIZE
-#define NCLUSTERSDIR 1
+#include "lz.h"
+
+#define CLUSTERSIZE 4096 /*  Padrão de fs_format e das imagens antigas */
+#define MINCLUSTER 4096
+#define MAXCLUSTER (1024 * 1024)
+#define FATSIZE 65536 /*  Entradas endereçáveis com uma FAT de 16 bits */
+#define DIRSIZE 128 /*  Múltiplo de 16: o diretório ocupa setores inteiros */
+#define HASHSIZE 256 /*  Potência de 2, ao menos DIRSIZE */
+#define MAXOPEN 128 /*  Descritores abertos ao mesmo tempo */
+#define CACHESIZE 256 /*  Em agrupamentos de CLUSTERSIZE bytes */
+#define PREALLOC 16 /*  Agrupamentos reservados de uma vez para cada escrita */
+#define POOLSIZE 16 /*  Buffers de agrupamento guardados para reuso */
+#define RAMIN 4 /*  Janela inicial de read-ahead, em agrupamentos */
+#define RAMAX 64
+#define RAQUEUE 64 /*  Pedidos de read-ahead na fila */
+#define JSECTORS 1024 /*  Setores mínimos do journal de metadados, logo após o diretório */
+#define JMAGIC 0x4a534652 /*  Registro do journal */
+#define JSUPER 0x53534652 /*  Primeiro setor do journal */
+#define SMAGIC 0x32534652 /*  Superbloco, no setor 0 das imagens novas */
+#define SZMAGIC 0x5a534652 /*  Superbloco de uma imagem com compressão */
+#define ZMAGIC 0x43534652 /*  Agrupamento comprimido */
+#define NRESERVED 6 /*  Os valores 0 a 5 da FAT são marcas, não agrupamentos */
+#define INLINESIZE 1024 /*  Arquivos até este tamanho ficam junto do diretório */
+#define INLINE_BLOCK 1 /*  Agrupamento fictício de um arquivo guardado assim */
+#define FATPAGE 8 /*  Setores da FAT lidos de uma vez quando ela é carregada sob demanda */
+#define NODESIZE 4096 /*  Nó de uma árvore de subdiretório, no início do seu agrupamento */
+#define NODESECT (NODESIZE / SECTORSIZE)
+#define NODECACHE 128 /*  Nós de subdiretório em memória */
+#define JNODES 64 /*  Nós alterados que um registro do journal leva, no máximo */
+#define OPNODES 32 /*  Nós que uma única operação pode alterar, em até duas árvores */
+#define DMAGIC 0x44534652 /*  Nó de subdiretório */
+#define JNMAGIC 0x4e534652 /*  Registro do journal que também leva nós */
+#define COPYSIZE (1024 * 1024) /*  Trecho de rsfs_copy */
+
+#define DE_USED 1 /*  Bits de dir_entry.used */
+#define DE_INLINE 2
+#define DE_DIR 4 /*  Subdiretório: first_block é a raiz da sua árvore */
 
 #define NFORMATADO "Disco não formatado!\n"
 
-int formatado;
+/*  Trava global dos buffers reutilizados; a da fila de read-ahead,
+ *  ra_lock, está junto de ra_main. As de cada imagem estão em struct
+ *  rsfs. */
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
 
-unsigned short fat[FATSIZE];
 
+typedef struct {
+       char used; /*  DE_USED, mais DE_INLINE se os dados estão em inline */
+       char name[FS_NAMESIZE];
+       unsigned int first_block; /*  INLINE_BLOCK se DE_INLINE */
+       int size;
+} dir_entry;
+
+/*  Entradas do diretório no disco: 32 bytes nas imagens antigas, 64 nas
+ *  com superbloco, que têm espaço para o agrupamento em 32 bits */
 typedef struct {
        char used;
-       char name[25];
+       char name[FS_NAMESIZE];
        unsigned short first_block;
        int size;
-} dir_entry;
+} dir_entry_v1;
+
+typedef struct {
+       char used;
+       char name[FS_NAMESIZE];
+       unsigned int first_block;
+       int size;
+       char spare[28];
+} dir_entry_v2;
+
+/*  Subdiretórios são árvores B+ de nós de NODESIZE bytes, cada um em um
+ *  agrupamento. As folhas têm as entradas em ordem de nome e são ligadas
+ *  por next; nos nós internos, e[i].first_block é o filho com os nomes a
+ *  partir de e[i].name. Remoções não juntam nós. */
+typedef struct {
+  unsigned int magic;
+  int level; /*  0 nas folhas */
+  int count;
+  unsigned int next; /*  Folha seguinte (0 na última) */
+  unsigned int first; /*  Nó interno: filho com os nomes menores que e[0] */
+  dir_entry_v2 e[];
+} bnode;
+
+/*  Espaço para um nó inteiro, com o alinhamento de bnode */
+typedef union {
+  bnode n;
+  char raw[NODESIZE];
+} bnode_buf;
+
+#define NODECAP ((int) ((NODESIZE - sizeof(bnode)) / sizeof(dir_entry_v2)))
+
+/*  Geometria escolhida em fs_format. A FAT (de nclusters entradas), o
+ *  diretório e, se inline_size > 0, inline_size bytes para os dados de
+ *  cada entrada vêm logo depois, seguidos do journal se journal_sectors
+ *  > 0.
+ *  Uma desmontagem limpa deixa o journal vazio e grava clean, com o número
+ *  de agrupamentos livres e o seq do journal. O resumo só vale enquanto
+ *  nenhum registro for gravado com esse seq: a montagem seguinte não
+ *  repassa o journal nem lê a FAT inteira.
+ *  Nas imagens com compressão (magic SZMAGIC, que as versões anteriores
+ *  não montam), cada setor da FAT traz depois das entradas um byte por
+ *  agrupamento: os setores gravados dele comprimido, ou 0 se ele está
+ *  inteiro. */
+typedef struct {
+  unsigned int magic;
+  unsigned int cluster_size;
+  unsigned int fat_bits; /*  16 ou 32 */
+  unsigned int nclusters;
+  unsigned int journal_sectors;
+  unsigned int inline_size;
+  unsigned int clean;
+  unsigned int free_count;
+  unsigned int jseq;
+} superblock;
 
 typedef struct {
 	char mode; 
-	unsigned short current_block;
-	unsigned short offset;
+	unsigned int buffered; /*  Agrupamento cujos dados estão em buffer (0 se nenhum) */
+	unsigned int current_block;
+	int offset; /*  Posição em buffer, até o tamanho do agrupamento */
+	unsigned int last_block; /*  Fim da cadeia, incluindo a reserva */
+	unsigned int first_block; /*  Publicado no diretório com o tamanho */
+	int reserved; /*  Agrupamentos reservados após current_block */
+	int pos; /*  Bytes já lidos */
+	int size; /*  Tamanho do arquivo, publicado no diretório em fs_close */
+	char *buffer;
+	unsigned int *map; /*  Agrupamento físico de cada agrupamento lógico */
+	int map_len, map_cap;
+	int ra_window; /*  Agrupamentos lidos adiante do leitor */
+	int ra_until; /*  Último agrupamento lógico já pedido (-1 se nenhum) */
+	unsigned int ra_block; /*  Agrupamento físico de ra_until */
+	int ra_pending; /*  Pedidos ainda na fila, protegido por ra_lock */
+	int entry; /*  Entrada em dir, ou -1 se o arquivo está em um subdiretório */
+	unsigned int parent; /*  Raiz da árvore do subdiretório (0: diretório raiz) */
+	char name[FS_NAMESIZE];
+	int opened; /*  Descritor em uso, protegido por dir_lock */
+	int compress; /*  Grava os agrupamentos comprimidos */
+	char *zbuffer; /*  Agrupamento comprimido a caminho do disco */
+	pthread_mutex_t lock;
 } file;
 
-dir_entry dir[DIRSIZE];
+/*  Posição da cache de nós de subdiretório */
+#define NODE_CLEAN 0
+#define NODE_DIRTY 1 /*  Alterado desde o último commit */
+#define NODE_WRITING 2 /*  No commit em andamento, a caminho do seu lugar */
 
-file fildes[DIRSIZE];
+typedef struct {
+  unsigned int cluster; /*  0: posição livre */
+  int state;
+  unsigned int used; /*  Relógio do último acesso */
+} node_slot;
 
-char buffer_r[CLUSTERSIZE], buffer_w[CLUSTERSIZE];
 
-void fs_update() {
-  int i;
+/*  Buffers de agrupamento livres, entregues aos descritores em fs_open,
+ *  com o tamanho de cada um: as imagens montadas podem ter agrupamentos
+ *  de tamanhos diferentes */
+char *buffer_pool[POOLSIZE];
+int pool_sizes[POOLSIZE];
+int pool_count;
 
-  /*  Escrita da FAT */
-  for (i = 0; i < NSECTORSFAT; bl_write(i, (char *) fat + i*SECTORSIZE), i++); 
-  
-  /*  Escrita do diretório */
-  for (i = 0; i < NSECTORSDIR; bl_write(i + NSECTORSFAT, (char *) dir + i*SECTORSIZE), i++); 
+
+/*  Journal de metadados: um setor de início (JSUPER) seguido de
+ *  registros, cada um com um cabeçalho e as novas imagens dos setores
+ *  alterados. Os setores só voltam aos seus lugares no checkpoint, quando
+ *  o journal enche. Imagens sem journal gravam direto nos lugares. */
+typedef struct {
+  unsigned int magic;
+  unsigned int seq;
+  unsigned int count; /*  Setores que seguem o cabeçalho */
+  unsigned int checksum; /*  Do cabeçalho (com 0 aqui) e dos setores */
+  unsigned char sectors[]; /*  Destino de cada setor, até o fim do cabeçalho */
+} jheader;
+
+/*  Início de um agrupamento comprimido, seguido de size bytes de lz */
+typedef struct {
+  unsigned int magic;
+  unsigned int size;
+} zheader;
+
+
+/*  Estado de uma imagem montada. Travas, sempre adquiridas nesta ordem:
+ *  dir_lock (diretório, índice de nomes e estado aberto/fechado dos
+ *  descritores), fildes[].lock (estado de um descritor), alloc_lock (FAT,
+ *  mapa livre e marcas de setores sujos da FAT), fat_lock (carga sob
+ *  demanda da FAT), node_lock (cache de nós de subdiretório). commit_lock
+ *  elege o líder de fs_update. */
+struct rsfs {
+  bl_device *dev;
+  cache_t *cache;
+  pthread_rwlock_t dir_lock;
+  pthread_mutex_t alloc_lock;
+  pthread_mutex_t fat_lock;
+  pthread_mutex_t node_lock;
+  pthread_mutex_t commit_lock;
+  pthread_cond_t commit_cond;
+
+  int formatado;
+  int cache_clusters; /*  -1: proporcional ao tamanho do agrupamento */
+  int durability;
+  int batching; /*  Lotes abertos por fs_batch */
+
+  /*  Contadores próprios de fs.c; os do dispositivo e da cache vêm de lá */
+  fs_counters counters;
+
+  /*  Geometria: as imagens antigas (version 1) não têm superbloco e têm
+   *  a FAT de 16 bits no setor 0. Os setores de metadados (FAT seguida
+   *  do diretório) começam em meta_start. */
+  int version;
+  int csize, spc; /*  Bytes e setores por agrupamento */
+  int fat_bits, fat_eps; /*  Bits por entrada da FAT e entradas por setor */
+  int fatsize; /*  Entradas da FAT */
+  int meta_start, fat_sectors, dir_sectors, inline_sectors, meta_sectors;
+  int inline_size; /*  0 se a imagem não guarda arquivos no diretório */
+  int fat_clusters, meta_clusters; /*  Marcados com 3 e 4 na FAT */
+  int jstart, jsectors, jhdr; /*  Journal e cabeçalho de um registro */
+  int zmap; /*  A FAT anota os agrupamentos comprimidos, em zsect */
+  int compress; /*  Novos arquivos e formatações com compressão */
+
+  unsigned int *fat;
+  unsigned char *zsect; /*  Setores gravados de cada agrupamento (0: inteiro) */
+  unsigned char *fat_loaded; /*  Setores da FAT já em fat, um byte cada */
+  dir_entry dir[DIRSIZE];
+  char *inline_data; /*  inline_size bytes por entrada */
+  file fildes[MAXOPEN];
+
+  /*  Mapa de agrupamentos livres (bit ligado = livre), mantido por fat_set */
+  unsigned long long *free_map;
+  int nclusters, free_count, next_fit;
+
+  /*  Índice hash dos nomes do diretório: listas encadeadas por balde e
+   *  pilha de entradas livres */
+  int name_hash[HASHSIZE], name_next[DIRSIZE];
+  int dir_free[DIRSIZE], dir_nfree;
+
+  /*  Setores da FAT e do diretório alterados desde o último fs_update e a
+   *  imagem de ambos como gravada pelo último fs_update, com a FAT seguida
+   *  do diretório como no disco */
+  unsigned char *fat_dirty, *dir_dirty; /*  dir_dirty inclui inline_data */
+  char *stage;
+  unsigned char *marked; /*  Setores do commit em andamento */
+
+  /*  Journal */
+  int journaled;
+  unsigned int jseq; /*  Próximo registro */
+  unsigned int clean_seq; /*  jseq do resumo válido no superbloco (0 se nenhum) */
+  int jhead; /*  Próximo setor livre do journal */
+  unsigned char *home_dirty; /*  Só no journal */
+  char *jstage;
+
+  /*  Group commit: quem chega a fs_update durante um commit espera o
+   *  próximo, que leva as alterações de todos */
+  int committing, commit_started, commit_finished;
+
+  /*  Nós de subdiretório: os alterados ficam presos aqui até o commit que
+   *  os grava; os demais formam uma cache LRU. dir_gen muda a cada
+   *  alteração de uma árvore. */
+  node_slot nodes[NODECACHE];
+  char *node_data; /*  NODESIZE bytes por posição, alocados no primeiro uso */
+  int nodes_dirty;
+  unsigned int node_clock, dir_gen;
+};
+
+/*  Imagem da interface fs_* sem handle, montada por fs_init sobre o
+ *  dispositivo de bl_init */
+rsfs_t default_instance = {
+  .dir_lock = PTHREAD_RWLOCK_INITIALIZER,
+  .alloc_lock = PTHREAD_MUTEX_INITIALIZER,
+  .fat_lock = PTHREAD_MUTEX_INITIALIZER,
+  .node_lock = PTHREAD_MUTEX_INITIALIZER,
+  .commit_lock = PTHREAD_MUTEX_INITIALIZER,
+  .commit_cond = PTHREAD_COND_INITIALIZER,
+  .cache_clusters = -1,
+  .durability = FS_SYNC_CLOSE
+};
+rsfs_t *default_fs = &default_instance;
+
+#define COUNT(field, n) __atomic_add_fetch(&fs->counters.field, (n), __ATOMIC_RELAXED)
+
+const char *op_names[FS_NOPS] = {
+  "format", "list", "create", "remove", "open", "close", "fallocate",
+  "write", "read", "seek", "pread", "sync", "mkdir", "rmdir",
+  "copy", "clone"
+};
+
+typedef struct {
+  rsfs_t *fs;
+  int op;
+  struct timespec start;
+} op_timer;
+
+op_timer op_begin(rsfs_t *fs, int op) {
+  op_timer t;
+
+  t.fs = fs;
+  t.op = op;
+  clock_gettime(CLOCK_MONOTONIC, &t.start);
+  return t;
 }
 
-void buffer_copy (char * from, char * to, int size) {
-  int i;
-  for (i = 0; i < size; i++)
-    from[i] = to[i];
+void op_end(op_timer *t) {
+  rsfs_t *fs = t->fs;
+  struct timespec end;
+  unsigned long long ns;
+  int b;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = (end.tv_sec - t->start.tv_sec) * 1000000000ULL + end.tv_nsec - t->start.tv_nsec;
+  b = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (b >= FS_HIST_BUCKETS)
+    b = FS_HIST_BUCKETS - 1;
+  COUNT(ops[t->op].count, 1);
+  COUNT(ops[t->op].total_ns, ns);
+  COUNT(ops[t->op].buckets[b], 1);
 }
 
-void flush_to_disk (unsigned short block, char * buffer) {
-  int i;
-  for (i = 0; i < CLUSTERSIZE / SECTORSIZE; i++)
-    bl_write(block * CLUSTERSIZE / SECTORSIZE + i, buffer + i * SECTORSIZE);
+/*  Mede a chamada inteira: op_end roda em qualquer return */
+#define TIMED(op) op_timer timer __attribute__((cleanup(op_end))) = op_begin(fs, op)
+
+#define MARK_DIRTY(map, s) ((map)[(s) / 8] |= 1 << ((s) % 8))
+#define IS_DIRTY(map, s) ((map)[(s) / 8] & 1 << ((s) % 8))
+
+
+/*  Calcula a geometria e aloca as tabelas que dependem dela. nclusters é
+ *  o número de entradas da FAT, que nas imagens antigas é sempre FATSIZE. */
+int geometry(rsfs_t *fs, int version, int csize, int bits, int nclusters,
+             int inline_size, int zmap) {
+  int entry, meta;
+
+  fs->version = version;
+  fs->csize = csize;
+  fs->spc = csize / SECTORSIZE;
+  fs->fat_bits = bits;
+  fs->fat_eps = SECTORSIZE * 8 / bits;
+  /*  Com os bytes de zsect, um setor leva 64 ou 128 entradas: cada um
+   *  continua cobrindo palavras inteiras do mapa livre */
+  fs->zmap = zmap;
+  if (zmap)
+    fs->fat_eps = SECTORSIZE * 8 / (bits + 8) / 64 * 64;
+  fs->fatsize = nclusters;
+  fs->meta_start = version == 1 ? 0 : 1;
+  fs->fat_sectors = (nclusters + fs->fat_eps - 1) / fs->fat_eps;
+  entry = version == 1 ? sizeof(dir_entry_v1) : sizeof(dir_entry_v2);
+  fs->dir_sectors = DIRSIZE * entry / SECTORSIZE;
+  fs->inline_size = inline_size;
+  fs->inline_sectors = DIRSIZE * inline_size / SECTORSIZE;
+  fs->meta_sectors = fs->fat_sectors + fs->dir_sectors + fs->inline_sectors;
+  fs->fat_clusters = (fs->meta_start + fs->fat_sectors + fs->spc - 1) / fs->spc;
+  fs->meta_clusters = (fs->meta_start + fs->meta_sectors + fs->spc - 1) / fs->spc;
+
+  /*  O journal cabe ao menos dois registros com todos os setores, ou um
+   *  que leve também JNODES nós */
+  meta = fs->meta_sectors;
+  fs->jhdr = (sizeof(jheader) + (meta + 7) / 8 + SECTORSIZE - 1) / SECTORSIZE;
+  fs->jstart = fs->meta_clusters * fs->spc;
+  fs->jsectors = JSECTORS;
+  if (fs->jsectors < 1 + 2 * (fs->jhdr + meta))
+    fs->jsectors = 1 + 2 * (fs->jhdr + meta);
+  if (fs->jsectors < 1 + fs->jhdr + meta + 1 + JNODES * NODESECT)
+    fs->jsectors = 1 + fs->jhdr + meta + 1 + JNODES * NODESECT;
+  fs->jsectors = (fs->jsectors + fs->spc - 1) / fs->spc * fs->spc;
+
+  free(fs->fat);
+  free(fs->zsect);
+  free(fs->fat_loaded);
+  free(fs->free_map);
+  free(fs->fat_dirty);
+  free(fs->dir_dirty);
+  free(fs->inline_data);
+  free(fs->stage);
+  free(fs->marked);
+  free(fs->home_dirty);
+  free(fs->jstage);
+  fs->fat = malloc(nclusters * sizeof(fs->fat[0]));
+  fs->zsect = zmap ? calloc(nclusters, 1) : NULL;
+  fs->fat_loaded = calloc(fs->fat_sectors, 1);
+  fs->free_map = malloc((nclusters + 63) / 64 * sizeof(fs->free_map[0]));
+  fs->fat_dirty = calloc((fs->fat_sectors + 7) / 8, 1);
+  fs->dir_dirty = calloc((fs->dir_sectors + fs->inline_sectors + 7) / 8, 1);
+  fs->inline_data = calloc(DIRSIZE, inline_size ? inline_size : 1);
+  fs->stage = calloc(meta, SECTORSIZE);
+  fs->marked = malloc((meta + 7) / 8);
+  fs->home_dirty = calloc((meta + 7) / 8, 1);
+  fs->jstage = malloc((fs->jhdr + meta + 1 + JNODES * NODESECT) * SECTORSIZE);
+  if (fs->fat == NULL || (zmap && fs->zsect == NULL) ||
+      fs->fat_loaded == NULL || fs->free_map == NULL || fs->fat_dirty == NULL ||
+      fs->dir_dirty == NULL || fs->inline_data == NULL || fs->stage == NULL || fs->marked == NULL || fs->home_dirty == NULL ||
+      fs->jstage == NULL) {
+    printf("Memória insuficiente para a FAT.\n");
+    return 0;
+  }
+  return 1;
 }
 
-void cluster_from_disk (unsigned short block, char * buffer) {
-  int i;
-  for (i = 0; i < CLUSTERSIZE / SECTORSIZE; i++)
-    bl_read(block * CLUSTERSIZE / SECTORSIZE + i, buffer + i * SECTORSIZE);
+/*  Agrupamentos da cache: CACHESIZE agrupamentos de CLUSTERSIZE bytes, a
+ *  não ser que fs_cache_size tenha escolhido outro número */
+int cache_count(rsfs_t *fs) {
+  int n;
+
+  if (fs->cache_clusters >= 0)
+    return fs->cache_clusters;
+  n = CACHESIZE * CLUSTERSIZE / fs->csize;
+  return n < 16 ? 16 : n;
 }
 
-int fs_init() {
-  int i;
+/*  Converte o setor s dos metadados entre as tabelas em memória e a sua
+ *  imagem em stage, no formato do disco */
+void meta_encode(rsfs_t *fs, int s) {
+  char *p = fs->stage + s * SECTORSIZE;
+  dir_entry_v1 *e1 = (dir_entry_v1 *) p;
+  dir_entry_v2 *e2 = (dir_entry_v2 *) p;
+  dir_entry *d;
+  int i, n;
+
+  memset(p, 0, SECTORSIZE);
+  if (s < fs->fat_sectors) {
+    i = s * fs->fat_eps;
+    n = fs->fatsize - i < fs->fat_eps ? fs->fatsize - i : fs->fat_eps;
+    if (fs->zmap)
+      memcpy(p + fs->fat_eps * fs->fat_bits / 8, fs->zsect + i, n);
+    if (fs->fat_bits == 32)
+      memcpy(p, fs->fat + i, n * sizeof(fs->fat[0]));
+    else
+      for (n += i; i < n; i++)
+        ((unsigned short *) p)[i % fs->fat_eps] = fs->fat[i];
+    return;
+  }
+  if (s >= fs->fat_sectors + fs->dir_sectors) {
+    s -= fs->fat_sectors + fs->dir_sectors;
+    memcpy(p, fs->inline_data + s * SECTORSIZE, SECTORSIZE);
+    return;
+  }
+  n = SECTORSIZE / (fs->version == 1 ? sizeof(*e1) : sizeof(*e2));
+  d = fs->dir + (s - fs->fat_sectors) * n;
+  for (i = 0; i < n; i++, d++) {
+    if (fs->version == 1) {
+      e1[i].used = d->used;
+      memcpy(e1[i].name, d->name, FS_NAMESIZE);
+      e1[i].first_block = d->first_block;
+      e1[i].size = d->size;
+    } else {
+      e2[i].used = d->used;
+      memcpy(e2[i].name, d->name, FS_NAMESIZE);
+      e2[i].first_block = d->first_block;
+      e2[i].size = d->size;
+    }
+  }
+}
 
-  /*  Leitura da FAT */
-  for (i = 0; i < NSECTORSFAT; bl_read(i, (char *) fat + i*SECTORSIZE), i++);
-  
-  /*  Leitura do diretório */
-  for (i = 0; i < NSECTORSDIR; bl_read(i + NSECTORSFAT, (char *) dir + i*SECTORSIZE), i++);
+/*  Converte o setor s da FAT, lido em p */
+void fat_decode(rsfs_t *fs, int s, char *p) {
+  int i, n;
 
-  /*  Inicialização da tabela de FDs */
-  for (i = 0; i < DIRSIZE; fildes[i].current_block = 0, i++);
+  i = s * fs->fat_eps;
+  n = fs->fatsize - i < fs->fat_eps ? fs->fatsize - i : fs->fat_eps;
+  if (fs->zmap)
+    memcpy(fs->zsect + i, p + fs->fat_eps * fs->fat_bits / 8, n);
+  if (fs->fat_bits == 32)
+    memcpy(fs->fat + i, p, n * sizeof(fs->fat[0]));
+  else
+    for (n += i; i < n; i++)
+      fs->fat[i] = ((unsigned short *) p)[i % fs->fat_eps];
+}
 
-  /*  Verificação de formatação */
-  for (i = 0; i < NCLUSTERSFAT && (fat[i] == 3); i++); 
+void meta_decode(rsfs_t *fs, int s) {
+  char *p = fs->stage + s * SECTORSIZE;
+  dir_entry_v1 *e1 = (dir_entry_v1 *) p;
+  dir_entry_v2 *e2 = (dir_entry_v2 *) p;
+  dir_entry *d;
+  int i, n;
 
-  if (i != NCLUSTERSFAT || fat[NCLUSTERSFAT] != 4) {
-	printf("Disco não formatado!\n");
-	formatado = 0;
+  if (s < fs->fat_sectors) {
+    fat_decode(fs, s, p);
+    return;
   }
-  else
-  	formatado = 1;
+  if (s >= fs->fat_sectors + fs->dir_sectors) {
+    s -= fs->fat_sectors + fs->dir_sectors;
+    memcpy(fs->inline_data + s * SECTORSIZE, p, SECTORSIZE);
+    return;
+  }
+  n = SECTORSIZE / (fs->version == 1 ? sizeof(*e1) : sizeof(*e2));
+  d = fs->dir + (s - fs->fat_sectors) * n;
+  for (i = 0; i < n; i++, d++) {
+    if (fs->version == 1) {
+      d->used = e1[i].used;
+      memcpy(d->name, e1[i].name, FS_NAMESIZE);
+      d->first_block = e1[i].first_block;
+      d->size = e1[i].size;
+    } else {
+      d->used = e2[i].used;
+      memcpy(d->name, e2[i].name, FS_NAMESIZE);
+      d->first_block = e2[i].first_block;
+      d->size = e2[i].size;
+    }
+  }
+}
 
-  return 1;
+#define FREE_BIT(c) (1ULL << ((c) % 64))
+
+/*  Lê a página da FAT com o setor s, se ele ainda não foi carregado, e
+ *  acende no mapa livre os agrupamentos livres dos setores novos. Cada
+ *  setor cobre palavras inteiras do mapa, que até aqui ninguém tocou. */
+void fat_load(rsfs_t *fs, int s) {
+  char page[FATPAGE * SECTORSIZE];
+  int first, n, k, i, end;
+
+  pthread_mutex_lock(&fs->fat_lock);
+  if (!fs->fat_loaded[s]) {
+    first = s / FATPAGE * FATPAGE;
+    n = fs->fat_sectors - first < FATPAGE ? fs->fat_sectors - first : FATPAGE;
+    if (!bl_dev_read_range(fs->dev, fs->meta_start + first, n, page))
+      memset(page, 0, sizeof(page)); /*  Sem a FAT, tudo fica ocupado */
+    COUNT(fat_loads, n);
+    for (k = first; k < first + n; k++) {
+      if (fs->fat_loaded[k])
+        continue;
+      fat_decode(fs, k, page + (k - first) * SECTORSIZE);
+      end = (k + 1) * fs->fat_eps < fs->nclusters ? (k + 1) * fs->fat_eps : fs->nclusters;
+      for (i = k * fs->fat_eps; i < end; i++)
+        if (i >= fs->meta_clusters && fs->fat[i] == 1)
+          fs->free_map[i / 64] |= FREE_BIT(i);
+      __atomic_store_n(&fs->fat_loaded[k], 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&fs->fat_lock);
 }
 
-int fs_format() {
-  int i; 
-  /*  Criação da FAT */
-  for (i = 0; i < NCLUSTERSFAT; fat[i++] = 3);
-  fat[NCLUSTERSFAT] = 4;
-  for (i++; i < FATSIZE; fat[i++] = 1);
+/*  Garante em memória a entrada c da FAT e o seu bit do mapa livre */
+void fat_need(rsfs_t *fs, int c) {
+  if (!__atomic_load_n(&fs->fat_loaded[c / fs->fat_eps], __ATOMIC_ACQUIRE))
+    fat_load(fs, c / fs->fat_eps);
+}
 
-  /*  Criação do Diretório */
-  for (i = 0; i < 128; dir[i++].used = 0);
+unsigned int fat_get(rsfs_t *fs, int c) {
+  fat_need(fs, c);
+  return fs->fat[c];
+}
 
-  fs_update();
+void fat_set(rsfs_t *fs, int i, unsigned int value) {
+  fat_need(fs, i);
+  if (i < fs->nclusters) {
+    if (value == 1 && !(fs->free_map[i / 64] & FREE_BIT(i))) {
+      fs->free_map[i / 64] |= FREE_BIT(i);
+      fs->free_count++;
+    } else if (value != 1 && fs->free_map[i / 64] & FREE_BIT(i)) {
+      fs->free_map[i / 64] &= ~FREE_BIT(i);
+      fs->free_count--;
+    }
+  }
+  fs->fat[i] = value;
+  if (value == 1 && fs->zmap)
+    fs->zsect[i] = 0;
+  MARK_DIRTY(fs->fat_dirty, i / fs->fat_eps);
+}
 
-  formatado = 1;
+/*  Setores gravados do agrupamento c, ou 0 se ele está inteiro */
+int zsect_get(rsfs_t *fs, int c) {
+  if (!fs->zmap)
+    return 0;
+  fat_need(fs, c);
+  return fs->zsect[c];
+}
 
-  return 1;
+void zsect_set(rsfs_t *fs, int c, int n) {
+  pthread_mutex_lock(&fs->alloc_lock);
+  fat_need(fs, c);
+  fs->zsect[c] = n;
+  MARK_DIRTY(fs->fat_dirty, c / fs->fat_eps);
+  pthread_mutex_unlock(&fs->alloc_lock);
 }
 
-int fs_free() {
-  int i, fsize;
+/*  Monta o mapa livre a partir da FAT inteira ou, com free_count de um
+ *  resumo (>= 0), deixa para fat_load os setores ainda não carregados */
+void free_map_build(rsfs_t *fs, int free_count) {
+  int i;
 
-  for (i = 0, fsize = 0; i < 128; i++) {
-	if (dir[i].used) {
-		fsize = fsize + dir[i].size;
-	}
+  /*  Só há agrupamentos até o fim da imagem, mesmo que a FAT seja maior */
+  fs->nclusters = bl_dev_size(fs->dev) / fs->spc < fs->fatsize ?
+                  bl_dev_size(fs->dev) / fs->spc : fs->fatsize;
+  fs->next_fit = fs->meta_clusters;
+
+  memset(fs->free_map, 0, (fs->fatsize + 63) / 64 * sizeof(fs->free_map[0]));
+  if (free_count >= 0) {
+    fs->free_count = free_count;
+    return;
+  }
+  memset(fs->fat_loaded, 1, fs->fat_sectors);
+  fs->free_count = 0;
+  for (i = fs->meta_clusters; i < fs->nclusters; i++) {
+    if (fs->fat[i] == 1) {
+      fs->free_map[i / 64] |= FREE_BIT(i);
+      fs->free_count++;
+    }
   }
+}
 
-  return (bl_size() - NSECTORSFAT - NSECTORSDIR) * SECTORSIZE - fsize;
+#define IS_FREE(c) (fat_need(fs, c), fs->free_map[(c) / 64] & FREE_BIT(c))
+
+/*  Primeiro agrupamento livre a partir de c, uma palavra do mapa por vez.
+ *  Retorna -1 se não há nenhum até o fim do disco. */
+int next_free(rsfs_t *fs, int c) {
+  int w, nwords = (fs->nclusters + 63) / 64;
+  unsigned long long bits;
+
+  if (c >= fs->nclusters)
+    return -1;
+  w = c / 64;
+  fat_need(fs, c);
+  bits = fs->free_map[w] & (~0ULL << (c % 64));
+  while (!bits && ++w < nwords) {
+    fat_need(fs, w * 64);
+    bits = fs->free_map[w];
+  }
+  if (!bits)
+    return -1;
+  return w * 64 + __builtin_ctzll(bits);
 }
 
-int fs_list(char *buffer, int size) {
-  int i, psize;
-  char *p = buffer;
-  
-  if (!formatado && printf(NFORMATADO)) return 0;
-  
-  for (i = 0, psize = 0; i < 128 && p != buffer + size; i++) {
-	if (dir[i].used) {
-	  psize = sprintf(p, "%s\t\t%d\n", dir[i].name, dir[i].size);
-	  p = p + psize;
-	}
+/*  Aloca até want agrupamentos contíguos, de preferência começando em goal,
+ *  e os encadeia na FAT terminando em 2. Sem um trecho livre desse tamanho,
+ *  fica com o maior encontrado. Retorna o primeiro agrupamento (0 se o
+ *  disco está cheio) e o tamanho do trecho em *len. */
+int run_alloc(rsfs_t *fs, int goal, int want, int *len) {
+  int c, n, best, best_len, scanned;
+
+  best = best_len = 0;
+  if (goal >= fs->meta_clusters && goal < fs->nclusters && IS_FREE(goal)) {
+    for (n = 1; n < want && goal + n < fs->nclusters && IS_FREE(goal + n); n++);
+    best = goal;
+    best_len = n;
   }
-  if (psize == 0)
-	buffer[0] = '\0';
-  
-  return 1;
+
+  if (fs->next_fit < fs->meta_clusters || fs->next_fit >= fs->nclusters)
+    fs->next_fit = fs->meta_clusters;
+  c = fs->next_fit;
+  scanned = 0;
+  while (best_len < want && scanned < fs->nclusters) {
+    n = next_free(fs, c);
+    if (n == -1) { /*  Volta ao início do disco */
+      scanned += fs->nclusters - c;
+      c = fs->meta_clusters;
+      continue;
+    }
+    scanned += n - c;
+    c = n;
+    for (n = 1; n < want && c + n < fs->nclusters && IS_FREE(c + n); n++);
+    if (n > best_len) {
+      best = c;
+      best_len = n;
+    }
+    c += n;
+    scanned += n;
+  }
+
+  COUNT(allocations, 1);
+  COUNT(alloc_scanned, scanned);
+  if (!best_len)
+    return 0;
+  for (c = best; c < best + best_len - 1; c++)
+    fat_set(fs, c, c + 1);
+  fat_set(fs, c, 2);
+  fs->next_fit = best + best_len;
+  *len = best_len;
+  return best;
 }
 
-int fs_create(char* file_name) {
-  int i, j;
+/*  Libera a cadeia que começa em c */
+void chain_free(rsfs_t *fs, int c) {
+  int next;
 
-  if (!formatado && printf(NFORMATADO)) return 0;
-  
-  for (i = 0; i < 128 && dir[i].used; i++) {
-	if (dir[i].used && !strcmp(dir[i].name, file_name)) {
-	  printf("Arquivo já existente.\n");
-	  return -1;
-	}
+  while (c != 2) {
+    next = fat_get(fs, c);
+    fat_set(fs, c, 1);
+    c = next;
   }
+}
 
-  if (i == 128) {
-	printf("Não há espaço no diretório.\n");
-	return 0;
+/*  Próximo agrupamento para a escrita em file: usa a reserva se houver ou
+ *  reserva um novo trecho contíguo logo após o fim da cadeia, grande o
+ *  bastante para os bytes que ainda faltam escrever. Exige a trava do
+ *  descritor. */
+int next_block_w(rsfs_t *fs, int file, int cb, int remaining) {
+  int run, len, want;
+
+  if (fs->fildes[file].reserved) {
+    fs->fildes[file].reserved--;
+    return fat_get(fs, cb);
   }
 
-  if (strlen(file_name) > 25) {
-	printf("O nome excede o máximo.\n");
-	return 0;
+  pthread_mutex_lock(&fs->alloc_lock);
+  want = remaining / fs->csize + 1;
+  if (want < PREALLOC)
+    want = PREALLOC;
+  if (want > fs->free_count)
+    want = fs->free_count;
+  if (!(run = run_alloc(fs, cb + 1, want, &len))) {
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return 0;
   }
+  fat_set(fs, cb, run);
+  pthread_mutex_unlock(&fs->alloc_lock);
+  fs->fildes[file].reserved = len - 1;
+  fs->fildes[file].last_block = run + len - 1;
+  return run;
+}
 
-  dir[i].used = 1;
-  strcpy(dir[i].name, file_name); 
-  dir[i].size = 0;
-  dir[i].first_block = 0;
+/*  Primeiro trecho da cadeia de um escritor que ainda está em buffer,
+ *  para bytes bytes ao todo. O buffer passa a ser o do primeiro
+ *  agrupamento. Exige a trava do descritor. */
+unsigned int chain_start(rsfs_t *fs, int file, int bytes) {
+  int run, len, want;
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  want = (bytes + fs->csize - 1) / fs->csize;
+  if (want < PREALLOC)
+    want = PREALLOC;
+  if (want > fs->free_count)
+    want = fs->free_count;
+  run = run_alloc(fs, 0, want, &len);
+  pthread_mutex_unlock(&fs->alloc_lock);
+  if (!run)
+    return 0;
+  fs->fildes[file].first_block = fs->fildes[file].current_block = run;
+  fs->fildes[file].buffered = run;
+  fs->fildes[file].last_block = run + len - 1;
+  fs->fildes[file].reserved = len - 1;
+  return run;
+}
 
-  for (j = NCLUSTERSFAT; j < FATSIZE && !dir[i].first_block; j++) {
-	if (fat[j] == 1) {
-		dir[i].first_block = j;
-		fat[j] = 2;
-	}
-  }
+void dir_touch(rsfs_t *fs, int i) {
+  MARK_DIRTY(fs->dir_dirty, i / (DIRSIZE / fs->dir_sectors));
+}
 
-  fs_update();
+/*  Marca os setores de inline_data com os primeiros size bytes de i */
+void inline_touch(rsfs_t *fs, int i, int size) {
+  int s;
 
-  return i;
+  s = fs->dir_sectors + i * fs->inline_size / SECTORSIZE;
+  for (; size > 0; size -= SECTORSIZE, s++)
+    MARK_DIRTY(fs->dir_dirty, s);
 }
 
-int fs_remove(char *file_name) {
-  int i,j,rem = -1;
 
-  if (!formatado && printf(NFORMATADO)) return 0;
-  
-  for (i = 0; i < 128 && rem == -1; i++) {
-	if (dir[i].used && !strcmp(dir[i].name, file_name))
-	  rem = i;
-  }
+unsigned int hash_name(char *name) {
+  unsigned int h = 2166136261u;
 
-  if (i == 128) {
-	printf("Arquivo não existe.\n");
-	return -1;
-  }
+  while (*name)
+    h = (h ^ (unsigned char) *name++) * 16777619u;
+  return h & (HASHSIZE - 1);
+}
 
-  dir[rem].used = 0;
-  j = dir[rem].first_block;
+void dir_index(rsfs_t *fs, int i) {
+  unsigned int h = hash_name(fs->dir[i].name);
 
-  while(fat[j] != 2) {
-	rem = j;
-	j = fat[j];
-	fat[rem] = 1;
-  }
-  fat[j] = 1;
+  fs->name_next[i] = fs->name_hash[h];
+  fs->name_hash[h] = i;
+}
+
+void dir_unindex(rsfs_t *fs, int i) {
+  int *p;
+
+  for (p = &fs->name_hash[hash_name(fs->dir[i].name)]; *p != i; p = &fs->name_next[*p]);
+  *p = fs->name_next[i];
+}
 
+void dir_index_build(rsfs_t *fs) {
+  int i;
+
+  for (i = 0; i < HASHSIZE; fs->name_hash[i++] = -1);
+  fs->dir_nfree = 0;
+  for (i = DIRSIZE - 1; i >= 0; i--) {
+    if (fs->dir[i].used)
+      dir_index(fs, i);
+    else
+      fs->dir_free[fs->dir_nfree++] = i;
+  }
+}
 
-  fs_update();
+/*  Retorna a entrada do arquivo ou -1 se ele não existe */
+int dir_lookup(rsfs_t *fs, char *file_name) {
+  int i;
 
+  for (i = fs->name_hash[hash_name(file_name)];
+       i != -1 && strcmp(fs->dir[i].name, file_name); i = fs->name_next[i]);
   return i;
 }
 
-int fs_open(char *file_name, int mode) {
-  int i, rem, fb, entry;
+/*  Converte para stage os setores sujos de uma tabela, a partir do setor
+ *  first dos metadados, anota-os em marked e limpa as marcas. Retorna o
+ *  número de setores. */
+int collect_dirty(rsfs_t *fs, unsigned char *map, int nsectors, int first) {
+  int i, n;
+
+  i = n = 0;
+  while (i < nsectors) {
+    if (i % 8 == 0 && !map[i / 8]) { /*  Byte inteiro limpo */
+      i += 8;
+      continue;
+    }
+    if (IS_DIRTY(map, i)) {
+      meta_encode(fs, first + i);
+      MARK_DIRTY(fs->marked, first + i);
+      n++;
+    }
+    i++;
+  }
+  memset(map, 0, (nsectors + 7) / 8);
+  return n;
+}
 
-  for (i = 0; i < 128; i++) /*  Busca pelo arquivo */
-	if (dir[i].used && !strcmp(dir[i].name, file_name)) 
-		break;
- 
-  if (fildes[i].current_block) {
-	printf("Arquivo já aberto.\n");
-	return -1;
-  } 
-  
-  if (mode == FS_R) { /*  Modo de leitura */
-	if (i == 128) {
-      printf("Arquivo não existe.\n");
-      return -1;
-	}
-	entry = i;
+unsigned int checksum(char *p, int len) {
+  unsigned int h = 2166136261u;
+
+  while (len--)
+    h = (h ^ (unsigned char) *p++) * 16777619u;
+  return h;
+}
+
+/*  Grava a partir de stage os trechos contíguos de setores marcados em map */
+void write_marked(rsfs_t *fs, unsigned char *map) {
+  int s, run;
+
+  for (s = 0; s < fs->meta_sectors; s += run) {
+    for (run = 0; s + run < fs->meta_sectors && IS_DIRTY(map, s + run); run++);
+    if (run)
+      bl_dev_submit_write(fs->dev, fs->meta_start + s, run, fs->stage + s * SECTORSIZE);
+    else
+      run = 1;
   }
-  else if (mode == FS_W) { /*  Modo de escrita */
-	if (i == 128) { /*  Arquivo não existe */
-		entry = fs_create(file_name);
-	}
-	else { /*  Arquivo existe */
-	  entry = i;
-	  dir[entry].size = 0;
-	  fb = dir[i].first_block;
-	  i = fb;
-  	  while(fat[i] != 2) {
-	    rem = i;
-	    i = fat[i];
-	    fat[rem] = 1;
-      }
-      fat[i] = 1;
-	  fat[fb] = 2;
-	  i = fb;
+  bl_wait();
+}
 
-	  fs_update();
-	}
+/*  Leva aos seus lugares os setores que só estão no journal e o recomeça
+ *  vazio a partir de jseq */
+void checkpoint(rsfs_t *fs) {
+  jheader *h = (jheader *) fs->jstage;
+
+  write_marked(fs, fs->home_dirty);
+  bl_dev_sync(fs->dev);
+  memset(fs->home_dirty, 0, (fs->meta_sectors + 7) / 8);
+
+  memset(fs->jstage, 0, SECTORSIZE);
+  h->magic = JSUPER;
+  h->seq = fs->jseq;
+  bl_dev_write_range(fs->dev, fs->jstart, 1, fs->jstage);
+  bl_dev_sync(fs->dev);
+  fs->jhead = 1;
+}
+
+/*  Aplica a stage os registros válidos do journal e faz o checkpoint.
+ *  Chamada por fs_init, que depois converte stage para as tabelas. */
+int journal_replay(rsfs_t *fs) {
+  char *journal;
+  jheader *h;
+  unsigned int sum;
+  unsigned int *list;
+  char *p;
+  int pos, s, n, len, i, nodes;
+
+  if ((journal = malloc(fs->jsectors * SECTORSIZE)) == NULL) {
+    printf("Memória insuficiente para o journal.\n");
+    return 0;
   }
+  h = (jheader *) journal;
+  memset(fs->home_dirty, 0, (fs->meta_sectors + 7) / 8);
+  if (!bl_dev_read_range(fs->dev, fs->jstart, fs->jsectors, journal) || h->magic != JSUPER)
+    fs->jseq = time(NULL); /*  Journal nunca iniciado */
   else {
-	printf("Erro ao abrir arquivo, modo não reconhecido.\n");
-	return -1;
+    fs->jseq = h->seq;
+    for (pos = 1; pos < fs->jsectors; pos += len, fs->jseq++) {
+      h = (jheader *) (journal + pos * SECTORSIZE);
+      len = fs->jhdr + h->count;
+      if ((h->magic != JMAGIC && h->magic != JNMAGIC) || h->seq != fs->jseq ||
+          h->count > fs->meta_sectors || pos + len > fs->jsectors)
+        break;
+      nodes = 0;
+      list = (unsigned int *) (journal + (pos + len) * SECTORSIZE);
+      if (h->magic == JNMAGIC) { /*  Seguem a lista dos nós e as suas imagens */
+        if (pos + len + 1 > fs->jsectors || list[0] > JNODES ||
+            pos + len + 1 + list[0] * NODESECT > fs->jsectors)
+          break;
+        nodes = list[0];
+        len += 1 + nodes * NODESECT;
+      }
+      sum = h->checksum;
+      h->checksum = 0;
+      if (checksum((char *) h, len * SECTORSIZE) != sum)
+        break; /*  Registro incompleto: o commit não terminou */
+
+      p = (char *) h + fs->jhdr * SECTORSIZE;
+      for (s = n = 0; s < fs->meta_sectors && n < h->count; s++) {
+        if (!IS_DIRTY(h->sectors, s))
+          continue;
+        memcpy(fs->stage + s * SECTORSIZE, p, SECTORSIZE);
+        MARK_DIRTY(fs->home_dirty, s);
+        p += SECTORSIZE;
+        n++;
+      }
+      /*  Os nós vão direto para os seus agrupamentos */
+      for (i = 0; i < nodes; i++)
+        if (list[1 + i] >= fs->meta_clusters && list[1 + i] < fs->fatsize)
+          bl_dev_write_range(fs->dev, list[1 + i] * fs->spc, NODESECT,
+                             (char *) list + SECTORSIZE + i * NODESIZE);
+    }
   }
 
-  fildes[entry].offset = 0;
-  fildes[entry].current_block = dir[entry].first_block;
-  fildes[entry].mode = mode;
-  #ifdef DEBUG
-  printf("Primeiro bloco: %d\n", fildes[entry].current_block);
-  #endif 
-  return entry;
+  free(journal);
+  checkpoint(fs);
+  return 1;
 }
 
-int fs_close(int file)  {
- 
-  if (!fildes[file].current_block) {
-	printf("Arquivo não aberto.\n");
-	return -1;
-  }
+/*  Posição do nó c na cache, ou -1. Exige node_lock. */
+int node_find(rsfs_t *fs, unsigned int c) {
+  int i;
 
-  if (fildes[file].mode == FS_W) {
-    if (fildes[file].offset) /*  Ainda há coisas para serem escritas */
-      flush_to_disk(fildes[file].current_block, buffer_w);
-	
-    fs_update();
+  for (i = 0; i < NODECACHE && fs->nodes[i].cluster != c; i++);
+  return i < NODECACHE ? i : -1;
+}
+
+/*  Posição livre ou com o nó limpo usado há mais tempo, ou -1 se não há
+ *  nenhuma. A cache é alocada no primeiro uso. Exige node_lock. */
+int node_victim(rsfs_t *fs) {
+  int i, best = -1;
+
+  if (fs->node_data == NULL &&
+      (fs->node_data = malloc((size_t) NODECACHE * NODESIZE)) == NULL)
+    return -1;
+  for (i = 0; i < NODECACHE; i++) {
+    if (!fs->nodes[i].cluster)
+      return i;
+    if (fs->nodes[i].state == NODE_CLEAN &&
+        (best == -1 || fs->nodes[i].used < fs->nodes[best].used))
+      best = i;
   }
+  return best;
+}
 
-  fildes[file].current_block = 0;
-  return file; 
+/*  Copia para p os nós alterados, com os seus agrupamentos em list, e os
+ *  marca a caminho do disco. Exige node_lock. Retorna o número de nós. */
+int nodes_collect(rsfs_t *fs, unsigned int *list, char *p) {
+  int i, n = 0;
+
+  for (i = 0; i < NODECACHE; i++) {
+    if (fs->nodes[i].state != NODE_DIRTY)
+      continue;
+    memcpy(p + n * NODESIZE, fs->node_data + (size_t) i * NODESIZE, NODESIZE);
+    list[n++] = fs->nodes[i].cluster;
+    fs->nodes[i].state = NODE_WRITING;
+  }
+  fs->nodes_dirty = 0;
+  return n;
 }
 
-int fs_write(char *buffer, int size, int file) {
-  unsigned long write_count, write_offset;
-  unsigned short i, cb;
+/*  Grava nos seus agrupamentos os n nós de p, que depois disso podem sair
+ *  da cache */
+void nodes_write(rsfs_t *fs, unsigned int *list, char *p, int n) {
+  int i;
 
-  #ifdef DEBUG
-  printf("Bloco atual: %d\n", fildes[file].current_block);
-  #endif
+  for (i = 0; i < n; i++)
+    bl_dev_submit_write(fs->dev, list[i] * fs->spc, NODESECT, p + i * NODESIZE);
+  bl_wait();
+  pthread_mutex_lock(&fs->node_lock);
+  for (i = 0; i < NODECACHE; i++)
+    if (fs->nodes[i].state == NODE_WRITING)
+      fs->nodes[i].state = NODE_CLEAN;
+  pthread_mutex_unlock(&fs->node_lock);
+}
 
-  if (!fildes[file].current_block) {
-    printf("Arquivo não aberto.\n");
-	return 0;
+/*  Converte para stage os setores alterados, sob as travas para que cada
+ *  operação entre inteira, e os grava: no journal, com uma barreira que
+ *  marca o commit, ou direto nos lugares. Os nós de subdiretório
+ *  alterados vão no mesmo registro e só depois para os seus lugares. Só o
+ *  líder do commit entra. */
+void meta_commit(rsfs_t *fs) {
+  jheader *h = (jheader *) fs->jstage;
+  unsigned int *list;
+  char *p, *images;
+  int s, count, nodes;
+
+  pthread_rwlock_rdlock(&fs->dir_lock);
+  /*  O pior caso tem de caber no que resta do journal; os nós só mudam
+   *  com dir_lock para escrita */
+  nodes = fs->nodes_dirty;
+  if (fs->journaled &&
+      fs->jhead + fs->jhdr + fs->meta_sectors + (nodes ? 1 + nodes * NODESECT : 0) > fs->jsectors)
+    checkpoint(fs);
+
+  memset(fs->marked, 0, (fs->meta_sectors + 7) / 8);
+  pthread_mutex_lock(&fs->alloc_lock);
+  count = collect_dirty(fs, fs->fat_dirty, fs->fat_sectors, 0);
+  count += collect_dirty(fs, fs->dir_dirty, fs->dir_sectors + fs->inline_sectors,
+                         fs->fat_sectors);
+  pthread_mutex_unlock(&fs->alloc_lock);
+  /*  Depois dos setores no registro: a lista dos nós e as suas imagens */
+  list = (unsigned int *) (fs->jstage + (fs->jhdr + count) * SECTORSIZE);
+  images = (char *) list + SECTORSIZE;
+  nodes = 0;
+  if (fs->nodes_dirty) {
+    memset(list, 0, SECTORSIZE);
+    pthread_mutex_lock(&fs->node_lock);
+    nodes = list[0] = nodes_collect(fs, list + 1, images);
+    pthread_mutex_unlock(&fs->node_lock);
   }
-  if (fs_free() < size) {
-	printf("Não há espaço suficiente no disco.\n");
-	return 0;
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  COUNT(commits, 1);
+  COUNT(metadata_bytes, count * SECTORSIZE + nodes * NODESIZE);
+  if (!fs->journaled || (!count && !nodes)) {
+    /*  Os nós antes dos setores que apontam para eles, com uma barreira
+     *  entre os dois quando a durabilidade pede a ordem */
+    if (nodes) {
+      nodes_write(fs, list + 1, images, nodes);
+      if (fs->durability != FS_SYNC_NONE)
+        bl_dev_sync(fs->dev);
+    }
+    write_marked(fs, fs->marked);
+    if (fs->durability != FS_SYNC_NONE)
+      bl_dev_sync(fs->dev);
+    return;
   }
 
-  #ifdef DEBUG
-  printf("Escrita\n");
-  #endif
-
-  write_count = 0;
-  write_offset = 0;
-  cb = fildes[file].current_block;
-
-  while (fildes[file].offset + size > CLUSTERSIZE) { /*  A escrita começa e termina em blocos diferentes */
-	if (fildes[file].offset < CLUSTERSIZE) {
-		write_count += SECTORSIZE - (fildes[file].offset % SECTORSIZE);
-		size -= write_count;
-    	buffer_copy(buffer_w + fildes[file].offset, buffer + write_offset, write_count);
-		write_offset += write_count;
-	}
-    
-	fildes[file].offset = (fildes[file].offset + write_count) % CLUSTERSIZE;
-	
-	if (!fildes[file].offset) { /*  Todos os setores do agrupamento estão usados */
-		for (i = NCLUSTERSFAT; fat[i] != 1; i++);
-
-		flush_to_disk(cb, buffer_w);
-		fat[cb] = i;
-		fat[i] = 2;
-		cb = i;
-		fildes[file].current_block = cb;
-	}
-    #ifdef DEBUG
-	printf("Inside while\n");	
-    printf("Texto: %s\nCluster: %d\n", buffer_w, cb);
-    #endif
-	
-    if (fs_free() < size) {
-	  printf("Não há espaço suficiente no disco.\n");
-	  return write_count;
+  memset(fs->jstage, 0, fs->jhdr * SECTORSIZE);
+  h->magic = nodes ? JNMAGIC : JMAGIC;
+  h->seq = fs->jseq;
+  h->count = count;
+  memcpy(h->sectors, fs->marked, (fs->meta_sectors + 7) / 8);
+  p = fs->jstage + fs->jhdr * SECTORSIZE;
+  for (s = 0; s < fs->meta_sectors; s++) {
+    if (IS_DIRTY(fs->marked, s)) {
+      memcpy(p, fs->stage + s * SECTORSIZE, SECTORSIZE);
+      MARK_DIRTY(fs->home_dirty, s);
+      p += SECTORSIZE;
     }
   }
+  count += fs->jhdr + (nodes ? 1 + nodes * NODESECT : 0);
+  h->checksum = checksum(fs->jstage, count * SECTORSIZE);
+
+  COUNT(metadata_bytes, (fs->jhdr + (nodes ? 1 : 0)) * SECTORSIZE);
+  bl_dev_submit_write(fs->dev, fs->jstart + fs->jhead, count, fs->jstage);
+  bl_wait();
+  /*  Sem a barreira, a escrita de volta da cache de páginas pode levar
+   *  ao disco o que vem depois antes do registro. Em FS_SYNC_NONE ela só
+   *  falta quando nada é gravado nos lugares: os setores só vão no
+   *  checkpoint, que tem a sua, mas os nós vão logo a seguir, e um nó no
+   *  lugar sem o registro que aloca os seus agrupamentos corromperia o
+   *  diretório. */
+  if (fs->durability != FS_SYNC_NONE || nodes)
+    bl_dev_sync(fs->dev);
+  fs->jhead += count;
+  fs->jseq++;
+  /*  Já duráveis no journal, os nós podem ir para os lugares: o replay os
+   *  grava de novo */
+  if (nodes)
+    nodes_write(fs, list + 1, images, nodes);
+}
 
-  if (fs_free() < size) {
-	printf("Não há espaço suficiente no disco.\n");
-	return write_count;
+/*  Espera o fim do commit em andamento e assume a liderança. Exige
+ *  commit_lock e retorna o número do novo commit. */
+int commit_lead(rsfs_t *fs) {
+  while (fs->committing)
+    pthread_cond_wait(&fs->commit_cond, &fs->commit_lock);
+  fs->committing = 1;
+  return ++fs->commit_started;
+}
+
+void commit_done(rsfs_t *fs, int id) {
+  fs->commit_finished = id;
+  fs->committing = 0;
+  pthread_cond_broadcast(&fs->commit_cond);
+}
+
+/*  Garante que as alterações de metadados feitas até aqui estejam
+ *  gravadas. Um commit que começa depois da chegada leva todas elas. */
+void meta_sync(rsfs_t *fs) {
+  int id, need;
+
+  pthread_mutex_lock(&fs->commit_lock);
+  need = fs->commit_started + 1;
+  while (fs->commit_finished < need) {
+    if (fs->committing) {
+      pthread_cond_wait(&fs->commit_cond, &fs->commit_lock);
+      continue;
+    }
+    id = commit_lead(fs);
+    pthread_mutex_unlock(&fs->commit_lock);
+    meta_commit(fs);
+    pthread_mutex_lock(&fs->commit_lock);
+    commit_done(fs, id);
   }
-  
-  /*  Escrita no setor corrente */
-  write_count += size;
-  buffer_copy(buffer_w + fildes[file].offset, buffer + write_offset, size);
-  
-  #ifdef DEBUG
-  printf("Texto: %s\nCluster: %d\n", buffer_w, cb);
-  #endif
- 
-  /*  Atualização do arquivo */ 
-  fildes[file].offset = (fildes[file].offset + size) % CLUSTERSIZE;
-  dir[file].size += write_count;
+  pthread_mutex_unlock(&fs->commit_lock);
+}
 
-  if (!fildes[file].offset) {
-	for (i = NCLUSTERSFAT; fat[i] != 1; i++);
-	
-	flush_to_disk(cb, buffer_w);
-	fat[cb] = i;
-	fat[i] = 2;
-	cb = i;
-	fildes[file].current_block = cb;
+/*  Espera as escritas de dados já enfileiradas por esta thread e, fora de
+ *  um lote, chama meta_sync */
+void fs_update(rsfs_t *fs) {
+  COUNT(updates, 1);
+  bl_wait();
+  if (__atomic_load_n(&fs->batching, __ATOMIC_RELAXED))
+    return;
+  meta_sync(fs);
+}
+
+/*  Trava dir_lock para escrita com espaço na cache para os nós que uma
+ *  operação altera: se já há nós alterados demais, faz antes o commit
+ *  deles, mesmo dentro de um lote */
+void dir_wrlock(rsfs_t *fs) {
+  pthread_rwlock_wrlock(&fs->dir_lock);
+  while (fs->nodes_dirty > JNODES - OPNODES) {
+    pthread_rwlock_unlock(&fs->dir_lock);
+    meta_sync(fs);
+    pthread_rwlock_wrlock(&fs->dir_lock);
   }
- 
-  #ifdef DEBUG 
-  printf("Tamanho: %d\n", dir[file].size);
-  #endif
+}
 
-  return write_count;
+/*  Garante a cache de nós antes de uma alteração, que não pode falhar
+ *  no meio por falta dela, e espaço no journal para os nós */
+int nodes_ready(rsfs_t *fs) {
+  int ok;
+
+  /*  Um registro do journal tem de caber os nós de várias operações */
+  if (fs->journaled && 1 + fs->jhdr + fs->meta_sectors + 1 + JNODES * NODESECT > fs->jsectors) {
+    printf("Journal pequeno demais para subdiretórios e clones.\n");
+    return 0;
+  }
+  pthread_mutex_lock(&fs->node_lock);
+  ok = node_victim(fs) != -1;
+  pthread_mutex_unlock(&fs->node_lock);
+  if (!ok)
+    printf("Memória insuficiente para os diretórios.\n");
+  return ok;
 }
 
-int fs_read(char *buffer, int size, int file) {
-  unsigned long read_count, read_offset;
-  unsigned short cb;
+/*  Lê o nó c em n, da cache ou do disco. Exige dir_lock. */
+int node_read(rsfs_t *fs, unsigned int c, bnode *n) {
+  int i;
 
-  if (!fildes[file].current_block) {
-    printf("Arquivo não aberto.\n");
-	return 0;
+  pthread_mutex_lock(&fs->node_lock);
+  if ((i = node_find(fs, c)) != -1) {
+    memcpy(n, fs->node_data + (size_t) i * NODESIZE, NODESIZE);
+    fs->nodes[i].used = ++fs->node_clock;
+    pthread_mutex_unlock(&fs->node_lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&fs->node_lock);
+
+  COUNT(node_loads, 1);
+  if (c < fs->meta_clusters || c >= fs->nclusters ||
+      !bl_dev_read_range(fs->dev, c * fs->spc, NODESECT, (char *) n) ||
+      n->magic != DMAGIC || n->count < 0 || n->count > NODECAP) {
+    printf("Diretório corrompido.\n");
+    return 0;
+  }
+  pthread_mutex_lock(&fs->node_lock);
+  if (node_find(fs, c) == -1 && (i = node_victim(fs)) != -1) {
+    memcpy(fs->node_data + (size_t) i * NODESIZE, n, NODESIZE);
+    fs->nodes[i].cluster = c;
+    fs->nodes[i].state = NODE_CLEAN;
+    fs->nodes[i].used = ++fs->node_clock;
   }
+  pthread_mutex_unlock(&fs->node_lock);
+  return 1;
+}
 
-  #ifdef DEBUG
-  printf("Leitura\n");
-  #endif
+/*  Guarda a nova versão do nó c, que fica presa na cache até o commit.
+ *  Exige dir_lock para escrita (por dir_wrlock, que garante a posição) e
+ *  nodes_ready. */
+void node_write(rsfs_t *fs, unsigned int c, bnode *n) {
+  int i;
+
+  pthread_mutex_lock(&fs->node_lock);
+  if ((i = node_find(fs, c)) == -1) {
+    i = node_victim(fs);
+    fs->nodes[i].cluster = c;
+    fs->nodes[i].state = NODE_CLEAN;
+  }
+  memcpy(fs->node_data + (size_t) i * NODESIZE, n, NODESIZE);
+  if (fs->nodes[i].state != NODE_DIRTY) {
+    fs->nodes[i].state = NODE_DIRTY;
+    fs->nodes_dirty++;
+  }
+  fs->nodes[i].used = ++fs->node_clock;
+  fs->dir_gen++;
+  pthread_mutex_unlock(&fs->node_lock);
+}
 
+/*  Tira da cache e libera na FAT o nó c, que nenhum commit está gravando */
+void node_free(rsfs_t *fs, unsigned int c) {
+  int i;
 
-  read_count = 0;
-  read_offset = 0;
-  cb = fildes[file].current_block; 
-  
-  if (!fildes[file].offset) {
-    cluster_from_disk(cb, buffer_r);	
+  pthread_mutex_lock(&fs->node_lock);
+  if ((i = node_find(fs, c)) != -1) {
+    if (fs->nodes[i].state == NODE_DIRTY)
+      fs->nodes_dirty--;
+    fs->nodes[i].cluster = 0;
   }
-  
+  pthread_mutex_unlock(&fs->node_lock);
+  pthread_mutex_lock(&fs->alloc_lock);
+  fat_set(fs, c, 1);
+  pthread_mutex_unlock(&fs->alloc_lock);
+}
 
-  while (fildes[file].offset + size > CLUSTERSIZE) {
-	if (fildes[file].offset < CLUSTERSIZE) {
-		read_count += fat[cb] == 2 ? 
-					  dir[file].size % CLUSTERSIZE - fildes[file].offset:
-					  SECTORSIZE - (fildes[file].offset % SECTORSIZE);
-		size -= read_count;
-    	buffer_copy(buffer + read_offset, buffer_r + fildes[file].offset, read_count);
-		read_offset += read_count;
-	}
-	
-	fildes[file].offset = (fildes[file].offset + read_count) % CLUSTERSIZE;
+/*  Agrupamento para um nó novo, de preferência goal. Retorna 0 se o disco
+ *  está cheio. */
+unsigned int node_alloc(rsfs_t *fs, unsigned int goal) {
+  int c = 0, len;
 
-	if (!fildes[file].offset){
-		cb = fat[cb];
-		fildes[file].current_block = cb;
-		cluster_from_disk(cb, buffer_r);
-	}
-    
-    #ifdef DEBUG
-	printf("Inside while\n");
-    printf("Texto: %s\nCluster: %d\nOffset: %d\n ", buffer, cb, fildes[file].offset);
-    #endif
+  pthread_mutex_lock(&fs->alloc_lock);
+  if (fs->free_count)
+    c = run_alloc(fs, goal, 1, &len);
+  pthread_mutex_unlock(&fs->alloc_lock);
+  return c;
+}
+
+void node_init(bnode *n, int level) {
+  memset(n, 0, NODESIZE);
+  n->magic = DMAGIC;
+  n->level = level;
+}
 
+/*  Quantas entradas de n têm nome até name */
+int node_bound(bnode *n, char *name) {
+  int lo = 0, hi = n->count, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (strncmp(n->e[mid].name, name, FS_NAMESIZE) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  
-  if(fildes[file].offset == (dir[file].size % CLUSTERSIZE) && fat[cb] == 2)
-    return read_count;
-  
-  if (fat[cb] == 2) {
-	read_count += dir[file].size % CLUSTERSIZE > size + fildes[file].offset ?
-				  size :
-				  dir[file].size % CLUSTERSIZE - fildes[file].offset;
- 	buffer_copy(buffer + read_offset, buffer_r + fildes[file].offset, read_count - read_offset);
-    fildes[file].offset = (fildes[file].offset + read_count - read_offset) % CLUSTERSIZE;
+  return lo;
+}
+
+/*  Filho de um nó interno com os nomes de que i entradas são menores */
+unsigned int node_child(bnode *n, int i) {
+  return i ? n->e[i - 1].first_block : n->first;
+}
+
+void node_insert(bnode *n, int i, dir_entry_v2 *e) {
+  memmove(n->e + i + 1, n->e + i, (n->count - i) * sizeof(*e));
+  n->e[i] = *e;
+  n->count++;
+}
+
+/*  Divide o nó cheio n, que está em c, passando a metade de cima para r
+ *  em um agrupamento novo. Deixa em sep o menor nome que vai para r e
+ *  retorna o agrupamento dele (0 se o disco está cheio). */
+unsigned int node_split(rsfs_t *fs, unsigned int c, bnode *n, bnode *r, char *sep) {
+  unsigned int rc;
+  int h = n->count / 2;
+
+  if (!(rc = node_alloc(fs, c + 1)))
+    return 0;
+  node_init(r, n->level);
+  memcpy(sep, n->e[h].name, FS_NAMESIZE);
+  if (n->level) { /*  A entrada do meio sobe; o seu filho é o primeiro de r */
+    r->first = n->e[h].first_block;
+    r->count = n->count - h - 1;
+    memcpy(r->e, n->e + h + 1, r->count * sizeof(n->e[0]));
+  } else {
+    r->count = n->count - h;
+    memcpy(r->e, n->e + h, r->count * sizeof(n->e[0]));
+    r->next = n->next;
+    n->next = rc;
   }
-  else {
-    read_count += size;
-    buffer_copy(buffer + read_offset, buffer_r + fildes[file].offset, size);
-    fildes[file].offset = (fildes[file].offset + size) % CLUSTERSIZE;
+  memset(n->e + h, 0, (n->count - h) * sizeof(n->e[0]));
+  n->count = h;
+  node_write(fs, c, n);
+  node_write(fs, rc, r);
+  return rc;
+}
+
+/*  Desce da raiz root até a folha onde name está ou estaria, que fica em
+ *  n, e deixa em *i quantas entradas dela têm nome até name. Retorna o
+ *  agrupamento da folha (0 em erro). Exige dir_lock. */
+unsigned int bt_leaf(rsfs_t *fs, unsigned int root, char *name, bnode *n, int *i) {
+  unsigned int c = root;
+
+  if (!node_read(fs, c, n))
+    return 0;
+  while (1) {
+    *i = node_bound(n, name);
+    if (!n->level)
+      return c;
+    c = node_child(n, *i);
+    if (!node_read(fs, c, n))
+      return 0;
   }
-	
-  if (!fildes[file].offset){
-	cb = fat[cb];
-	fildes[file].current_block = cb;
-	cluster_from_disk(cb, buffer_r);
+}
+
+/*  Procura name na árvore de raiz root. Retorna 1 com a entrada em e, 0
+ *  se ele não existe ou -1 em erro. Exige dir_lock. */
+int bt_lookup(rsfs_t *fs, unsigned int root, char *name, dir_entry_v2 *e) {
+  bnode_buf b;
+  bnode *n = &b.n;
+  int i;
+
+  if (!bt_leaf(fs, root, name, n, &i))
+    return -1;
+  if (!i || strncmp(n->e[i - 1].name, name, FS_NAMESIZE))
+    return 0;
+  *e = n->e[i - 1];
+  return 1;
+}
+
+/*  Primeira entrada com nome depois de after, em e. Retorna 0 se não há
+ *  nenhuma ou -1 em erro. Exige dir_lock. */
+int bt_next(rsfs_t *fs, unsigned int root, char *after, dir_entry_v2 *e) {
+  bnode_buf b;
+  bnode *n = &b.n;
+  int i;
+
+  if (!bt_leaf(fs, root, after, n, &i))
+    return -1;
+  while (i >= n->count) {
+    if (!n->next)
+      return 0;
+    if (!node_read(fs, n->next, n))
+      return -1;
+    i = 0;
   }
+  *e = n->e[i];
+  return 1;
+}
 
-  #ifdef DEBUG
-  printf("Texto: %s\nCluster: %d\nOffset: %d\n ", buffer, cb, fildes[file].offset);
-  #endif
+/*  Insere e, cujo nome ainda não está na árvore de raiz root, dividindo
+ *  no caminho os nós cheios. A raiz continua no mesmo agrupamento: cheia,
+ *  o seu conteúdo desce para dois nós novos. Exige dir_lock para escrita.
+ *  Retorna 0 em erro ou se o disco está cheio. */
+int bt_insert(rsfs_t *fs, unsigned int root, dir_entry_v2 *e) {
+  bnode_buf b1, b2, b3;
+  bnode *n = &b1.n, *child = &b2.n, *r = &b3.n, *t;
+  dir_entry_v2 k;
+  unsigned int c, cc, rc;
+  int i;
 
-  return read_count;
+  if (!node_read(fs, root, n))
+    return 0;
+  if (n->count == NODECAP) {
+    if (!(cc = node_alloc(fs, root + 1)))
+      return 0;
+    memcpy(child, n, NODESIZE);
+    memset(&k, 0, sizeof(k));
+    if (!(rc = node_split(fs, cc, child, r, k.name))) {
+      node_free(fs, cc);
+      return 0;
+    }
+    k.first_block = rc;
+    node_init(n, child->level + 1);
+    n->first = cc;
+    node_insert(n, 0, &k);
+    node_write(fs, root, n);
+  }
+
+  c = root;
+  while (n->level) {
+    i = node_bound(n, e->name);
+    cc = node_child(n, i);
+    if (!node_read(fs, cc, child))
+      return 0;
+    if (child->count == NODECAP) {
+      memset(&k, 0, sizeof(k));
+      if (!(rc = node_split(fs, cc, child, r, k.name)))
+        return 0;
+      k.first_block = rc;
+      node_insert(n, i, &k);
+      node_write(fs, c, n);
+      if (strncmp(e->name, k.name, FS_NAMESIZE) >= 0) {
+        cc = rc;
+        t = child;
+        child = r;
+        r = t;
+      }
+    }
+    c = cc;
+    t = n;
+    n = child;
+    child = t;
+  }
+  node_insert(n, node_bound(n, e->name), e);
+  node_write(fs, c, n);
+  return 1;
 }
 
+/*  Substitui a entrada com o nome de e. Exige dir_lock para escrita. */
+int bt_update(rsfs_t *fs, unsigned int root, dir_entry_v2 *e) {
+  bnode_buf b;
+  bnode *n = &b.n;
+  unsigned int c;
+  int i;
+
+  if (!(c = bt_leaf(fs, root, e->name, n, &i)) || !i ||
+      strncmp(n->e[i - 1].name, e->name, FS_NAMESIZE))
+    return 0;
+  n->e[i - 1] = *e;
+  node_write(fs, c, n);
+  return 1;
+}
+
+/*  Retira name da árvore de raiz root. Nós que esvaziam ficam na árvore.
+ *  Exige dir_lock para escrita. */
+int bt_delete(rsfs_t *fs, unsigned int root, char *name) {
+  bnode_buf b;
+  bnode *n = &b.n;
+  unsigned int c;
+  int i;
+
+  if (!(c = bt_leaf(fs, root, name, n, &i)) || !i ||
+      strncmp(n->e[i - 1].name, name, FS_NAMESIZE))
+    return 0;
+  n->count--;
+  memmove(n->e + i - 1, n->e + i, (n->count - i + 1) * sizeof(n->e[0]));
+  memset(n->e + n->count, 0, sizeof(n->e[0]));
+  node_write(fs, c, n);
+  return 1;
+}
+
+/*  Libera os nós da árvore de raiz c. Exige dir_lock para escrita e a
+ *  liderança do commit. */
+void bt_free(rsfs_t *fs, unsigned int c) {
+  bnode_buf b;
+  bnode *n = &b.n;
+  int i;
+
+  if (node_read(fs, c, n) && n->level)
+    for (i = 0; i <= n->count; i++)
+      bt_free(fs, node_child(n, i));
+  node_free(fs, c);
+}
+
+void entry_from_v2(dir_entry *d, dir_entry_v2 *e) {
+  d->used = e->used;
+  memcpy(d->name, e->name, FS_NAMESIZE);
+  d->first_block = e->first_block;
+  d->size = e->size;
+}
+
+void entry_to_v2(dir_entry_v2 *e, dir_entry *d) {
+  memset(e, 0, sizeof(*e));
+  e->used = d->used;
+  memcpy(e->name, d->name, FS_NAMESIZE);
+  e->first_block = d->first_block;
+  e->size = d->size;
+}
+
+/*  Entradas de um diretório qualquer: parent é 0 para a raiz, em dir, ou
+ *  a raiz da árvore de um subdiretório, onde entry é sempre -1 */
+
+/*  Procura name em parent. Retorna 1 com a entrada em d e o seu índice em
+ *  *entry, 0 se ele não existe ou -1 em erro. Exige dir_lock. */
+int ent_find(rsfs_t *fs, unsigned int parent, char *name, dir_entry *d, int *entry) {
+  dir_entry_v2 e;
+  int r;
+
+  if (!parent) {
+    if ((*entry = dir_lookup(fs, name)) == -1)
+      return 0;
+    *d = fs->dir[*entry];
+    return 1;
+  }
+  *entry = -1;
+  if ((r = bt_lookup(fs, parent, name, &e)) == 1)
+    entry_from_v2(d, &e);
+  return r;
+}
+
+/*  Acrescenta d, que ainda não está em parent. Exige dir_lock para
+ *  escrita. */
+int ent_add(rsfs_t *fs, unsigned int parent, dir_entry *d, int *entry) {
+  dir_entry_v2 e;
+  int i;
+
+  if (!parent) {
+    if (!fs->dir_nfree) {
+      printf("Não há espaço no diretório.\n");
+      return 0;
+    }
+    i = fs->dir_free[--fs->dir_nfree];
+    fs->dir[i] = *d;
+    dir_touch(fs, i);
+    dir_index(fs, i);
+    *entry = i;
+    return 1;
+  }
+  *entry = -1;
+  entry_to_v2(&e, d);
+  if (!nodes_ready(fs))
+    return 0;
+  if (!bt_insert(fs, parent, &e)) {
+    printf("Não há espaço suficiente no disco.\n");
+    return 0;
+  }
+  return 1;
+}
+
+/*  Grava d por cima da entrada de mesmo nome. Exige dir_lock para
+ *  escrita. */
+void ent_put(rsfs_t *fs, unsigned int parent, int entry, dir_entry *d) {
+  dir_entry_v2 e;
+
+  if (!parent) {
+    fs->dir[entry] = *d;
+    dir_touch(fs, entry);
+    return;
+  }
+  entry_to_v2(&e, d);
+  if (nodes_ready(fs))
+    bt_update(fs, parent, &e);
+}
+
+/*  Retira a entrada name de parent. Exige dir_lock para escrita. */
+void ent_del(rsfs_t *fs, unsigned int parent, int entry, char *name) {
+  if (!parent) {
+    dir_unindex(fs, entry);
+    fs->dir_free[fs->dir_nfree++] = entry;
+    fs->dir[entry].used = 0;
+    dir_touch(fs, entry);
+    return;
+  }
+  if (nodes_ready(fs))
+    bt_delete(fs, parent, name);
+}
+
+/*  Resolve os diretórios de path, devolvendo em *parent o último deles e
+ *  em name o componente final. Retorna 0, com a mensagem, se algum não
+ *  existe. Exige dir_lock. */
+int path_parent(rsfs_t *fs, char *path, unsigned int *parent, char *name) {
+  dir_entry d;
+  char *q;
+  int n, entry, r;
+
+  *parent = 0;
+  while (*path == '/')
+    path++;
+  while (1) {
+    for (q = path; *q && *q != '/'; q++);
+    n = q - path;
+    if (!n) {
+      printf("Caminho inválido.\n");
+      return 0;
+    }
+    if (n >= FS_NAMESIZE) {
+      printf("O nome excede o máximo.\n");
+      return 0;
+    }
+    memcpy(name, path, n);
+    name[n] = '\0';
+    while (*q == '/')
+      q++;
+    if (!*q)
+      return 1;
+    if ((r = ent_find(fs, *parent, name, &d, &entry)) <= 0 || !(d.used & DE_DIR)) {
+      if (r >= 0)
+        printf("Diretório não existe.\n");
+      return 0;
+    }
+    *parent = d.first_block;
+    path = q;
+  }
+}
+
+/*  Cadeias compartilhadas por fs_clone: uma árvore como as de
+ *  subdiretório, com uma entrada por cadeia usada por mais de um arquivo.
+ *  O nome é o primeiro agrupamento em hexadecimal e size o número de
+ *  arquivos a mais. A raiz fica na entrada 0 da FAT, que nas imagens com
+ *  superbloco não tem outro uso. */
+unsigned int share_root(rsfs_t *fs) {
+  unsigned int r;
+
+  if (fs->version == 1)
+    return 0;
+  r = fat_get(fs, 0);
+  return r >= NRESERVED ? r : 0;
+}
+
+/*  Arquivos a mais que usam a cadeia c. Exige dir_lock. */
+int share_count(rsfs_t *fs, unsigned int c) {
+  char key[FS_NAMESIZE];
+  unsigned int root = share_root(fs);
+  dir_entry_v2 e;
+
+  if (!root)
+    return 0;
+  sprintf(key, "%08x", c);
+  return bt_lookup(fs, root, key, &e) == 1 ? e.size : 0;
+}
+
+/*  Soma delta aos arquivos a mais que usam a cadeia c, criando a árvore
+ *  no primeiro clone. Exige dir_lock para escrita. Retorna 0 em erro ou
+ *  se falta espaço. */
+int share_add(rsfs_t *fs, unsigned int c, int delta) {
+  bnode_buf b;
+  char key[FS_NAMESIZE];
+  bnode *n = &b.n;
+  unsigned int root;
+  dir_entry_v2 e;
+  int r;
+
+  if (!nodes_ready(fs))
+    return 0;
+  if (!(root = share_root(fs))) {
+    if (!(root = node_alloc(fs, 0))) {
+      printf("Não há espaço suficiente no disco.\n");
+      return 0;
+    }
+    node_init(n, 0);
+    node_write(fs, root, n);
+    pthread_mutex_lock(&fs->alloc_lock);
+    fat_set(fs, 0, root);
+    pthread_mutex_unlock(&fs->alloc_lock);
+  }
+
+  sprintf(key, "%08x", c);
+  if ((r = bt_lookup(fs, root, key, &e)) == -1)
+    return 0;
+  if (!r) {
+    memset(&e, 0, sizeof(e));
+    e.used = DE_USED;
+    strcpy(e.name, key);
+    e.first_block = c;
+  }
+  e.size += delta;
+  if (e.size <= 0)
+    return !r || bt_delete(fs, root, key);
+  if (r)
+    return bt_update(fs, root, &e);
+  if (!bt_insert(fs, root, &e)) {
+    printf("Não há espaço suficiente no disco.\n");
+    return 0;
+  }
+  return 1;
+}
+
+/*  Solta a cadeia c de um arquivo, liberando os agrupamentos se nenhum
+ *  outro a usa. Exige dir_lock para escrita. */
+void chain_release(rsfs_t *fs, unsigned int c) {
+  if (share_count(fs, c)) {
+    share_add(fs, c, -1);
+    return;
+  }
+  pthread_mutex_lock(&fs->alloc_lock);
+  chain_free(fs, c);
+  pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+/*  Descritor aberto para a entrada name de parent (na raiz, para a
+ *  entrada entry), ou -1. Exige dir_lock. */
+int fd_lookup(rsfs_t *fs, unsigned int parent, int entry, char *name) {
+  int i;
+
+  for (i = 0; i < MAXOPEN; i++)
+    if (fs->fildes[i].opened && fs->fildes[i].parent == parent &&
+        (parent ? !strcmp(fs->fildes[i].name, name) : fs->fildes[i].entry == entry))
+      return i;
+  return -1;
+}
+
+char *buffer_get(int size) {
+  char *b = NULL;
+  int i;
+
+  pthread_mutex_lock(&pool_lock);
+  for (i = pool_count - 1; i >= 0 && pool_sizes[i] != size; i--);
+  if (i >= 0) {
+    b = buffer_pool[i];
+    pool_count--;
+    buffer_pool[i] = buffer_pool[pool_count];
+    pool_sizes[i] = pool_sizes[pool_count];
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (b == NULL && (b = malloc(size)) == NULL)
+    printf("Memória insuficiente para o buffer do arquivo.\n");
+  return b;
+}
+
+void buffer_put(char *b, int size) {
+  pthread_mutex_lock(&pool_lock);
+  if (pool_count < POOLSIZE) {
+    buffer_pool[pool_count] = b;
+    pool_sizes[pool_count++] = size;
+    b = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  free(b);
+}
+
+/*  Comprime os primeiros size bytes de buffer em zbuffer, com o
+ *  cabeçalho. Retorna os setores a gravar, ou 0 se não economizam
+ *  nenhum. */
+int cluster_compress(rsfs_t *fs, char *buffer, int size, char *zbuffer) {
+  zheader *h = (zheader *) zbuffer;
+  int max = (fs->spc - 1) * SECTORSIZE - sizeof(zheader);
+
+  if (max <= 0 || !(h->size = lz_compress(buffer, size, zbuffer + sizeof(zheader), max)))
+    return 0;
+  h->magic = ZMAGIC;
+  return (sizeof(zheader) + h->size + SECTORSIZE - 1) / SECTORSIZE;
+}
+
+/*  Descomprime em buffer o agrupamento lido em zbuffer */
+int cluster_expand(rsfs_t *fs, char *zbuffer, int n, char *buffer) {
+  zheader *h = (zheader *) zbuffer;
+
+  if (h->magic != ZMAGIC || h->size > n * SECTORSIZE - sizeof(zheader) ||
+      lz_decompress(zbuffer + sizeof(zheader), h->size, buffer, fs->csize) == -1) {
+    printf("Agrupamento comprimido corrompido.\n");
+    return 0;
+  }
+  return 1;
+}
+
+/*  Lê o agrupamento comprimido block, de n setores, para buffer */
+int cluster_read_z(rsfs_t *fs, unsigned int block, int n, char *buffer) {
+  char *z;
+  int ok;
+
+  if ((z = buffer_get(fs->csize)) == NULL)
+    return 0;
+  ok = bl_dev_read_range(fs->dev, block * fs->spc, n, z) && cluster_expand(fs, z, n, buffer);
+  buffer_put(z, fs->csize);
+  return ok;
+}
+
+/*  Apenas enfileira a escrita do agrupamento em buffer de file: o buffer
+ *  só pode ser reutilizado depois de bl_wait (ou fs_update). Com a
+ *  compressão, só os setores usados vão para o disco, e quantos são fica
+ *  na FAT. */
+void flush_to_disk (rsfs_t *fs, int file, unsigned int block) {
+  char *buffer = fs->fildes[file].buffer;
+  int n = 0;
+
+  cache_put(fs->cache, block, buffer);
+  if (fs->fildes[file].compress && (fs->fildes[file].zbuffer != NULL ||
+      (fs->fildes[file].zbuffer = buffer_get(fs->csize)) != NULL))
+	n = cluster_compress(fs, buffer, fs->fildes[file].offset, fs->fildes[file].zbuffer);
+  if (fs->zmap && (n || zsect_get(fs, block)))
+	zsect_set(fs, block, n);
+  if (n) {
+	COUNT(compressed, 1);
+	bl_dev_submit_write(fs->dev, block * fs->spc, n, fs->fildes[file].zbuffer);
+  } else
+	bl_dev_submit_write(fs->dev, block * fs->spc, fs->spc, buffer);
+}
+
+/*  Carrega o agrupamento block em buffer. Sem ele na cache, a leitura
+ *  segue com as que a thread já tem na fila, e a espera vale para todas.
+ *  Retorna 0 se alguma delas falhou. */
+int cluster_from_disk (rsfs_t *fs, unsigned int block, char * buffer) {
+  int n;
+
+  COUNT(cluster_loads, 1);
+  if (cache_get(fs->cache, block, buffer))
+    return 1;
+  if ((n = zsect_get(fs, block))) {
+    if (!cluster_read_z(fs, block, n, buffer))
+      return 0;
+    cache_put(fs->cache, block, buffer);
+    return 1;
+  }
+  bl_dev_submit_read(fs->dev, block * fs->spc, fs->spc, buffer);
+  if (!bl_wait())
+    return 0;
+  cache_put(fs->cache, block, buffer);
+  return 1;
+}
+
+/*  Read-ahead: uma thread segue a FAT adiante dos leitores sequenciais e
+ *  coloca os agrupamentos na cache, onde cluster_from_disk os encontra */
+typedef struct {
+  rsfs_t *fs;
+  int file;
+  unsigned int block;
+  int count;
+} ra_request;
+
+ra_request ra_queue[RAQUEUE];
+int ra_head, ra_count;
+pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ra_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t ra_done = PTHREAD_COND_INITIALIZER;
+pthread_once_t ra_once = PTHREAD_ONCE_INIT;
+
+void *ra_main(void *arg) {
+  char *buffer = NULL, *p, *z;
+  int size = 0;
+  rsfs_t *fs;
+  ra_request r;
+  unsigned int b, blocks[RAMAX];
+  int i, k, n, zs[RAMAX];
+
+  while (1) {
+	pthread_mutex_lock(&ra_lock);
+	while (!ra_count)
+	  pthread_cond_wait(&ra_work, &ra_lock);
+	r = ra_queue[ra_head];
+	fs = r.fs;
+	ra_head = (ra_head + 1) % RAQUEUE;
+	ra_count--;
+	pthread_mutex_unlock(&ra_lock);
+
+	/*  A cadeia não muda enquanto o arquivo está aberto para leitura, e
+	 *  fs_close espera os pedidos pendentes do descritor */
+	/*  O buffer cresce até a maior janela pedida */
+	if (r.count * fs->csize > size) {
+	  if ((p = realloc(buffer, r.count * fs->csize)) != NULL) {
+		buffer = p;
+		size = r.count * fs->csize;
+	  } else
+		r.count = size / fs->csize;
+	}
+	/*  A janela inteira fica em voo de uma vez: uma leitura por trecho
+	 *  contíguo e uma por agrupamento comprimido, cada um na sua posição
+	 *  do buffer, e uma espera só */
+	if (r.count > RAMAX)
+	  r.count = RAMAX;
+	b = r.block;
+	for (n = 0; n < r.count; n += k) {
+	  if ((zs[n] = zsect_get(fs, b))) {
+		bl_dev_submit_read(fs->dev, b * fs->spc, zs[n], buffer + n * fs->csize);
+		blocks[n] = b;
+		k = 1;
+		b = fat_get(fs, b);
+		continue;
+	  }
+	  for (k = 1; n + k < r.count && fat_get(fs, b + k - 1) == b + k && !zsect_get(fs, b + k); k++);
+	  bl_dev_submit_read(fs->dev, b * fs->spc, k * fs->spc, buffer + n * fs->csize);
+	  for (i = 0; i < k; i++) {
+		blocks[n + i] = b + i;
+		zs[n + i] = 0;
+	  }
+	  b = fat_get(fs, b + k - 1);
+	}
+	if (bl_wait()) {
+	  z = NULL;
+	  for (i = 0; i < r.count; i++) {
+		if (!zs[i])
+		  cache_put(fs->cache, blocks[i], buffer + i * fs->csize);
+		else if ((z != NULL || (z = buffer_get(fs->csize)) != NULL) &&
+		         cluster_expand(fs, buffer + i * fs->csize, zs[i], z))
+		  cache_put(fs->cache, blocks[i], z);
+	  }
+	  if (z != NULL)
+		buffer_put(z, fs->csize);
+	}
+
+	pthread_mutex_lock(&ra_lock);
+	if (!--fs->fildes[r.file].ra_pending)
+	  pthread_cond_broadcast(&ra_done);
+	pthread_mutex_unlock(&ra_lock);
+  }
+  return NULL;
+}
+
+void ra_start() {
+  pthread_t t;
+
+  if (!pthread_create(&t, NULL, ra_main, NULL))
+	pthread_detach(t);
+}
+
+/*  Chamada a cada agrupamento alcançado por uma leitura sequencial, com a
+ *  trava do descritor: aumenta a janela e, quando o que já foi pedido
+ *  chega a menos de meia janela do leitor, pede o próximo trecho */
+void readahead(rsfs_t *fs, int file) {
+  int l, last, count, i;
+  unsigned int b;
+
+  if (fs->fildes[file].ra_window < RAMAX)
+	fs->fildes[file].ra_window = fs->fildes[file].ra_window ? fs->fildes[file].ra_window * 2 : RAMIN;
+  if (fs->fildes[file].ra_window > cache_count(fs) / 4) /*  Não expulsar o que foi lido adiante */
+	fs->fildes[file].ra_window = cache_count(fs) / 4;
+  if (!fs->fildes[file].ra_window)
+	return;
+
+  l = fs->fildes[file].pos / fs->csize;
+  if (fs->fildes[file].ra_until < l) {
+	fs->fildes[file].ra_until = l;
+	fs->fildes[file].ra_block = fs->fildes[file].current_block;
+  }
+  if (fs->fildes[file].ra_until - l > fs->fildes[file].ra_window / 2)
+	return;
+
+  last = (fs->fildes[file].size - 1) / fs->csize;
+  count = l + fs->fildes[file].ra_window - fs->fildes[file].ra_until;
+  if (count > last - fs->fildes[file].ra_until)
+	count = last - fs->fildes[file].ra_until;
+  if (count <= 0)
+	return;
+
+  b = fat_get(fs, fs->fildes[file].ra_block);
+  pthread_mutex_lock(&ra_lock);
+  if (ra_count == RAQUEUE) { /*  Fila cheia: fica para o próximo agrupamento */
+	pthread_mutex_unlock(&ra_lock);
+	return;
+  }
+  ra_queue[(ra_head + ra_count++) % RAQUEUE] = (ra_request) { fs, file, b, count };
+  fs->fildes[file].ra_pending++;
+  COUNT(readahead_clusters, count);
+  pthread_cond_signal(&ra_work);
+  pthread_mutex_unlock(&ra_lock);
+
+  for (i = 1; i < count; i++)
+	b = fat_get(fs, b);
+  fs->fildes[file].ra_until += count;
+  fs->fildes[file].ra_block = b;
+}
+
+/*  Espera a thread de read-ahead terminar os pedidos de file */
+void readahead_drain(rsfs_t *fs, int file) {
+  pthread_mutex_lock(&ra_lock);
+  while (fs->fildes[file].ra_pending)
+	pthread_cond_wait(&ra_done, &ra_lock);
+  pthread_mutex_unlock(&ra_lock);
+}
+
+/*  Confere se a geometria do superbloco cabe no dispositivo de sectors
+ *  setores */
+int super_valid(superblock *sb, long long sectors) {
+  int spc;
+
+  if (sb->cluster_size < MINCLUSTER || sb->cluster_size > MAXCLUSTER ||
+      sb->cluster_size & (sb->cluster_size - 1))
+    return 0;
+  if (sb->fat_bits != 32 && (sb->fat_bits != 16 || sb->nclusters > FATSIZE))
+    return 0;
+  spc = sb->cluster_size / SECTORSIZE;
+  return sb->nclusters > NRESERVED && sb->nclusters <= sectors / spc &&
+         sb->journal_sectors % spc == 0 && sb->journal_sectors / spc < sb->nclusters &&
+         sb->inline_size % SECTORSIZE == 0 && sb->inline_size < sb->cluster_size;
+}
+
+/*  Confere se o resumo de uma desmontagem limpa ainda vale: o journal
+ *  continua vazio, sem nenhum registro gravado com o seq do resumo */
+int summary_valid(rsfs_t *fs, superblock *sb) {
+  char journal[2 * SECTORSIZE];
+  jheader *h = (jheader *) journal, *r = (jheader *) (journal + SECTORSIZE);
+
+  if (!sb->clean || !fs->jsectors || sb->free_count > fs->fatsize)
+    return 0;
+  if (!bl_dev_read_range(fs->dev, fs->jstart, 2, journal))
+    return 0;
+  return h->magic == JSUPER && h->seq == sb->jseq &&
+         !((r->magic == JMAGIC || r->magic == JNMAGIC) && r->seq == sb->jseq);
+}
+
+/*  Grava o superbloco com a geometria atual e, se clean, o resumo da
+ *  desmontagem limpa */
+void super_write(rsfs_t *fs, int clean) {
+  char sector[SECTORSIZE];
+  superblock *sb = (superblock *) sector;
+
+  memset(sector, 0, SECTORSIZE);
+  sb->magic = fs->zmap ? SZMAGIC : SMAGIC;
+  sb->cluster_size = fs->csize;
+  sb->fat_bits = fs->fat_bits;
+  sb->nclusters = fs->fatsize;
+  sb->journal_sectors = fs->jsectors;
+  sb->inline_size = fs->inline_size;
+  if (clean) {
+    sb->clean = 1;
+    sb->free_count = fs->free_count;
+    sb->jseq = fs->jseq;
+  }
+  fs->clean_seq = clean ? fs->jseq : 0;
+  bl_dev_write_range(fs->dev, 0, 1, sector);
+}
+
+/*  Montagem sem resumo: lê a FAT e o diretório inteiros, confere a
+ *  formatação das imagens antigas e repassa o journal */
+int mount_full(rsfs_t *fs) {
+  int i, n;
+
+  fs->clean_seq = 0;
+  /*  Leitura da FAT e do diretório */
+  if (!bl_dev_read_range(fs->dev, fs->meta_start, fs->meta_sectors, fs->stage))
+    return 0;
+  for (i = 0; i < fs->fat_sectors; i++)
+	meta_decode(fs, i);
+
+  if (fs->version == 1) {
+	/*  Verificação de formatação */
+	for (i = 0; i < fs->fat_clusters && (fs->fat[i] == 3); i++);
+	for (; i < fs->meta_clusters && (fs->fat[i] == 4); i++);
+	fs->formatado = i == fs->meta_clusters;
+
+	/*  Imagens formatadas sem journal continuam gravando direto */
+	for (n = i + fs->jsectors / fs->spc; i < n && (fs->fat[i] == 5); i++);
+	fs->journaled = fs->formatado && i == n;
+  } else
+	fs->journaled = fs->jsectors > 0;
+
+  if (!fs->formatado)
+	printf("Disco não formatado!\n");
+  if (fs->journaled && !journal_replay(fs))
+	return 0;
+  for (i = 0; i < fs->meta_sectors; i++)
+	meta_decode(fs, i);
+  return 1;
+}
+
+int rsfs_init(rsfs_t *fs) {
+  char sector[SECTORSIZE];
+  superblock *sb = (superblock *) sector;
+  int i, n, free_count = -1;
+
+  if (fs->cache == NULL && (fs->cache = cache_new()) == NULL)
+    return 0;
+
+  /*  Imagens com superbloco trazem a geometria; as demais são antigas */
+  if (!bl_dev_read_range(fs->dev, 0, 1, sector))
+    return 0;
+  fs->formatado = (sb->magic == SMAGIC || sb->magic == SZMAGIC) &&
+                 super_valid(sb, bl_dev_size(fs->dev));
+  if (fs->formatado) {
+	if (!geometry(fs, 2, sb->cluster_size, sb->fat_bits, sb->nclusters, sb->inline_size,
+	              sb->magic == SZMAGIC))
+	  return 0;
+	fs->jsectors = sb->journal_sectors;
+	if (summary_valid(fs, sb))
+	  free_count = sb->free_count;
+  } else if (!geometry(fs, 1, CLUSTERSIZE, 16, FATSIZE, 0, 0))
+	return 0;
+  fs->compress = fs->zmap;
+
+  if (free_count >= 0) {
+	/*  Desmontagem limpa: o journal está vazio e só o diretório é lido;
+	 *  a FAT vem por páginas, conforme as cadeias são percorridas */
+	n = fs->fat_sectors;
+	if (!bl_dev_read_range(fs->dev, fs->meta_start + n, fs->meta_sectors - n,
+	                       fs->stage + n * SECTORSIZE))
+	  return 0;
+	fs->journaled = 1;
+	fs->jseq = fs->clean_seq = sb->jseq;
+	fs->jhead = 1;
+	for (i = n; i < fs->meta_sectors; i++)
+	  meta_decode(fs, i);
+  } else if (!mount_full(fs))
+	return 0;
+
+  cache_init(fs->cache, cache_count(fs), fs->csize);
+  pthread_once(&ra_once, ra_start);
+  free_map_build(fs, free_count);
+  dir_index_build(fs);
+
+  /*  Nós de uma imagem montada antes por esta instância */
+  memset(fs->nodes, 0, sizeof(fs->nodes));
+  fs->nodes_dirty = 0;
+  fs->dir_gen++;
+
+  /*  Inicialização da tabela de FDs */
+  for (i = 0; i < MAXOPEN; i++) {
+    fs->fildes[i].current_block = 0;
+    fs->fildes[i].opened = 0;
+    pthread_mutex_init(&fs->fildes[i].lock, NULL);
+  }
+
+  return 1;
+}
+
+int rsfs_format(rsfs_t *fs) {
+  return rsfs_format_geometry(fs, CLUSTERSIZE, 0);
+}
+
+/*  Formata com agrupamentos de cluster_size bytes e FAT de fat_bits bits
+ *  (0: 16 se ela endereça todo o disco, senão 32). A geometria vai para o
+ *  superbloco. */
+int rsfs_format_geometry(rsfs_t *fs, int cluster_size, int fat_bits) {
+  TIMED(FS_OP_FORMAT);
+  int i, id, n, journal, ok;
+
+  if (cluster_size < MINCLUSTER || cluster_size > MAXCLUSTER ||
+      cluster_size & (cluster_size - 1) ||
+      (fat_bits != 0 && fat_bits != 16 && fat_bits != 32)) {
+	printf("Geometria inválida.\n");
+	return 0;
+  }
+  if (fs->compress && cluster_size > LZ_MAXBLOCK) {
+	printf("Compressão só com agrupamentos de até %d bytes.\n", LZ_MAXBLOCK);
+	return 0;
+  }
+  /*  Os setores são endereçados em int: o que passa disso fica sem uso */
+  n = (bl_dev_size(fs->dev) < INT_MAX ? bl_dev_size(fs->dev) : INT_MAX) /
+      (cluster_size / SECTORSIZE);
+  if (!fat_bits)
+	fat_bits = n > FATSIZE ? 32 : 16;
+  if (fat_bits == 16 && n > FATSIZE)
+	n = FATSIZE; /*  O resto do disco fica sem uso */
+
+  /*  As tabelas mudam de tamanho: nenhum commit pode estar em andamento */
+  pthread_mutex_lock(&fs->commit_lock);
+  id = commit_lead(fs);
+  pthread_mutex_unlock(&fs->commit_lock);
+  pthread_rwlock_wrlock(&fs->dir_lock);
+  pthread_mutex_lock(&fs->alloc_lock);
+
+  for (i = 0; i < MAXOPEN && !fs->fildes[i].opened; i++);
+  if (i < MAXOPEN) {
+	pthread_mutex_unlock(&fs->alloc_lock);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	pthread_mutex_lock(&fs->commit_lock);
+	commit_done(fs, id);
+	pthread_mutex_unlock(&fs->commit_lock);
+	printf("Há arquivos abertos.\n");
+	return 0;
+  }
+
+  ok = geometry(fs, 2, cluster_size, fat_bits, n, INLINESIZE, fs->compress);
+  if (ok && (n <= fs->meta_clusters || n <= NRESERVED)) {
+	printf("Disco pequeno demais para a geometria.\n");
+	ok = 0;
+  }
+  journal = n > fs->meta_clusters + fs->jsectors / fs->spc;
+  if (ok && !journal)
+	fs->jsectors = 0;
+
+  /*  Criação da FAT */
+  if (ok) {
+	for (i = 0; i < fs->fat_clusters; fs->fat[i++] = 3);
+	for (; i < fs->meta_clusters; fs->fat[i++] = 4);
+	for (; i < fs->meta_clusters + fs->jsectors / fs->spc; fs->fat[i++] = 5);
+	for (; i < NRESERVED; fs->fat[i++] = 3);
+	for (; i < n; fs->fat[i++] = 1);
+	memset(fs->fat_dirty, 0xff, (fs->fat_sectors + 7) / 8);
+	free_map_build(fs, -1);
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+
+  /*  Criação do Diretório */
+  if (ok) {
+	for (i = 0; i < DIRSIZE; fs->dir[i++].used = 0);
+	memset(fs->dir_dirty, 0xff, (fs->dir_sectors + fs->inline_sectors + 7) / 8);
+	dir_index_build(fs);
+	pthread_mutex_lock(&fs->node_lock); /*  Os subdiretórios se foram */
+	memset(fs->nodes, 0, sizeof(fs->nodes));
+	fs->nodes_dirty = 0;
+	fs->dir_gen++;
+	pthread_mutex_unlock(&fs->node_lock);
+  }
+
+  fs->formatado = ok;
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  if (!ok) {
+	pthread_mutex_lock(&fs->commit_lock);
+	commit_done(fs, id);
+	pthread_mutex_unlock(&fs->commit_lock);
+	return 0;
+  }
+  if (fs->cache != NULL)
+	cache_init(fs->cache, cache_count(fs), fs->csize);
+
+  /*  As tabelas novas vão direto para os lugares, depois o superbloco; só
+   *  então o journal começa, vazio */
+  bl_wait();
+  fs->jseq = fs->journaled ? fs->jseq + 1 : time(NULL);
+  fs->journaled = 0;
+  meta_commit(fs);
+  super_write(fs, 0);
+  if (journal) {
+	checkpoint(fs);
+	fs->journaled = 1;
+  } else if (fs->durability != FS_SYNC_NONE)
+	bl_dev_sync(fs->dev);
+  pthread_mutex_lock(&fs->commit_lock);
+  commit_done(fs, id);
+  pthread_mutex_unlock(&fs->commit_lock);
+
+  return 1;
+}
+
+int rsfs_durability(rsfs_t *fs, int mode) {
+  if (mode != FS_SYNC_NONE && mode != FS_SYNC_CLOSE && mode != FS_SYNC_WRITE) {
+	printf("Modo de durabilidade não reconhecido.\n");
+	return 0;
+  }
+  fs->durability = mode;
+  return 1;
+}
+
+/*  Liga ou desliga a compressão dos arquivos abertos para escrita daqui
+ *  em diante e das próximas formatações, que passam a anotar na FAT os
+ *  agrupamentos comprimidos. Uma imagem formatada sem compressão não a
+ *  ganha depois. */
+int rsfs_compression(rsfs_t *fs, int on) {
+  fs->compress = on != 0;
+  if (on && fs->formatado && !fs->zmap)
+	printf("Imagem formatada sem compressão: vale a partir da próxima formatação.\n");
+  return 1;
+}
+
+/*  Liga ou desliga a compressão dos próximos agrupamentos gravados por
+ *  file, aberto para escrita */
+int rsfs_compress(rsfs_t *fs, int file, int on) {
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  if (!fs->fildes[file].current_block || fs->fildes[file].mode != FS_W) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	printf("Arquivo não aberto para escrita.\n");
+	return 0;
+  }
+  if (on && !fs->zmap) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	printf("Imagem formatada sem compressão.\n");
+	return 0;
+  }
+  fs->fildes[file].compress = on != 0;
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+  return 1;
+}
+
+/*  Publica no diretório o tamanho e o início da cadeia de um escritor; um
+ *  arquivo ainda sem agrupamentos vai do buffer para inline_data. Exige
+ *  dir_lock para escrita. */
+void writer_publish(rsfs_t *fs, int file) {
+  int i = fs->fildes[file].entry;
+  dir_entry d;
+
+  d.used = DE_USED;
+  if (fs->fildes[file].current_block == INLINE_BLOCK) {
+	memcpy(fs->inline_data + i * fs->inline_size, fs->fildes[file].buffer,
+	       fs->fildes[file].size);
+	inline_touch(fs, i, fs->fildes[file].size);
+	d.used |= DE_INLINE;
+  }
+  strcpy(d.name, fs->fildes[file].name);
+  d.first_block = fs->fildes[file].first_block;
+  d.size = fs->fildes[file].size;
+  ent_put(fs, fs->fildes[file].parent, i, &d);
+}
+
+/*  Grava o agrupamento parcial de um escritor aberto e publica o tamanho
+ *  escrito até aqui no diretório. Exige dir_lock para escrita. */
+void writer_flush(rsfs_t *fs, int file) {
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  if (fs->fildes[file].current_block && fs->fildes[file].mode == FS_W) {
+	if (fs->fildes[file].offset && fs->fildes[file].current_block != INLINE_BLOCK &&
+	    fs->fildes[file].buffered == fs->fildes[file].current_block) {
+	  flush_to_disk(fs, file, fs->fildes[file].current_block);
+	  bl_wait();
+	}
+	writer_publish(fs, file);
+  }
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+}
+
+/*  Torna duráveis tudo o que foi escrito e as operações já concluídas */
+int rsfs_sync(rsfs_t *fs) {
+  TIMED(FS_OP_SYNC);
+  int i;
+
+  /*  Um descritor por vez: cada um pode alterar um nó */
+  for (i = 0; i < MAXOPEN; i++) {
+	dir_wrlock(fs);
+	writer_flush(fs, i);
+	pthread_rwlock_unlock(&fs->dir_lock);
+  }
+
+  fs_update(fs);
+  return bl_dev_sync(fs->dev);
+}
+
+int rsfs_cache_size(rsfs_t *fs, int nclusters) {
+  fs->cache_clusters = nclusters;
+  if (fs->cache == NULL) /*  Ainda não montada: vale a partir de rsfs_init */
+    return 1;
+  return cache_init(fs->cache, cache_count(fs), fs->csize);
+}
+
+long long rsfs_free(rsfs_t *fs) {
+  int n;
+
+  pthread_mutex_lock(&fs->alloc_lock);
+  n = fs->free_count;
+  pthread_mutex_unlock(&fs->alloc_lock);
+  return (long long) n * fs->csize;
+}
+
+int rsfs_list(rsfs_t *fs, char *buffer, int size) {
+  TIMED(FS_OP_LIST);
+  int i, psize;
+  char *p = buffer;
+  
+  pthread_rwlock_rdlock(&fs->dir_lock);
+  if (!fs->formatado && printf(NFORMATADO)) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return 0;
+  }
+  
+  buffer[0] = '\0';
+  for (i = 0; i < DIRSIZE; i++) {
+	if (!fs->dir[i].used)
+	  continue;
+	if (fs->dir[i].used & DE_DIR)
+	  psize = snprintf(p, buffer + size - p, "%s/\n", fs->dir[i].name);
+	else
+	  psize = snprintf(p, buffer + size - p, "%s\t\t%d\n", fs->dir[i].name, fs->dir[i].size);
+	if (psize >= buffer + size - p) { /*  Não cabe no buffer */
+	  *p = '\0';
+	  break;
+	}
+	p = p + psize;
+  }
+  pthread_rwlock_unlock(&fs->dir_lock);
+  
+  return 1;
+}
+
+/*  Cria em parent a entrada do arquivo name, que ainda não existe, e a
+ *  devolve em d e *entry. Exige dir_lock para escrita. */
+int dir_create(rsfs_t *fs, unsigned int parent, char *name, dir_entry *d, int *entry) {
+  int j;
+
+  if (!parent && !fs->dir_nfree) {
+	printf("Não há espaço no diretório.\n");
+	return 0;
+  }
+
+  /*  Arquivos novos começam vazios em inline_data, se a imagem permite;
+   *  nos subdiretórios, sempre com um agrupamento */
+  j = INLINE_BLOCK;
+  if (parent || !fs->inline_size) {
+	pthread_mutex_lock(&fs->alloc_lock);
+	j = run_alloc(fs, 0, 1, &j);
+	pthread_mutex_unlock(&fs->alloc_lock);
+  }
+  if (!j) {
+	printf("Não há espaço suficiente no disco.\n");
+	return 0;
+  }
+
+  d->used = j == INLINE_BLOCK ? DE_USED | DE_INLINE : DE_USED;
+  strcpy(d->name, name);
+  d->size = 0;
+  d->first_block = j;
+  if (!ent_add(fs, parent, d, entry)) {
+	if (j != INLINE_BLOCK) {
+	  pthread_mutex_lock(&fs->alloc_lock);
+	  fat_set(fs, j, 1);
+	  pthread_mutex_unlock(&fs->alloc_lock);
+	}
+	return 0;
+  }
+  return 1;
+}
+
+/*  Próximo arquivo do diretório raiz a partir de *pos, que começa em 0,
+ *  sem os subdiretórios. Retorna 0 quando não há mais arquivos. */
+int rsfs_readdir(rsfs_t *fs, int *pos, char *name, int *size) {
+  int i;
+
+  pthread_rwlock_rdlock(&fs->dir_lock);
+  for (i = *pos; i < DIRSIZE && (!fs->dir[i].used || fs->dir[i].used & DE_DIR); i++);
+  if (i < DIRSIZE) {
+	strcpy(name, fs->dir[i].name);
+	*size = fs->dir[i].size;
+  }
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  *pos = i + 1;
+  return i < DIRSIZE;
+}
+
+/*  Entre rsfs_batch(fs, 1) e rsfs_batch(fs, 0) as operações só gravam dados: um único
+ *  commit no fim leva os metadados de todas, ignorando o modo de
+ *  durabilidade. Lotes podem ser aninhados. */
+int rsfs_batch(rsfs_t *fs, int on) {
+  if (on)
+	__atomic_add_fetch(&fs->batching, 1, __ATOMIC_RELAXED);
+  else if (!__atomic_sub_fetch(&fs->batching, 1, __ATOMIC_RELAXED))
+	fs_update(fs);
+  return 1;
+}
+
+int rsfs_create(rsfs_t *fs, char* file_name) {
+  TIMED(FS_OP_CREATE);
+  char name[FS_NAMESIZE];
+  unsigned int parent;
+  dir_entry d;
+  int i, r;
+
+  dir_wrlock(fs);
+  if (!fs->formatado && printf(NFORMATADO)) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return -1;
+  }
+  i = -1;
+  if (path_parent(fs, file_name, &parent, name)) {
+	if ((r = ent_find(fs, parent, name, &d, &i)) == 1)
+	  printf("Arquivo já existente.\n");
+	if (r || !dir_create(fs, parent, name, &d, &i))
+	  i = -1;
+	else if (i == -1) /*  Em um subdiretório */
+	  i = 0;
+  }
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  if (i != -1)
+	fs_update(fs);
+
+  return i;
+}
+
+int rsfs_remove(rsfs_t *fs, char *file_name) {
+  TIMED(FS_OP_REMOVE);
+  char name[FS_NAMESIZE];
+  unsigned int parent;
+  dir_entry d;
+  int i, r = -1;
+
+  dir_wrlock(fs);
+  if (!fs->formatado && printf(NFORMATADO)) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return 0;
+  }
+
+  if (!path_parent(fs, file_name, &parent, name) ||
+      (r = ent_find(fs, parent, name, &d, &i)) <= 0) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	if (!r)
+	  printf("Arquivo não existe.\n");
+	return -1;
+  }
+
+  if (d.used & DE_DIR) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	printf("É um diretório.\n");
+	return -1;
+  }
+
+  if (fd_lookup(fs, parent, i, name) != -1) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	printf("Arquivo aberto.\n");
+	return -1;
+  }
+
+  ent_del(fs, parent, i, name);
+  if (!(d.used & DE_INLINE))
+	chain_release(fs, d.first_block);
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  fs_update(fs);
+
+  return i == -1 ? 0 : i;
+}
+
+/*  Raiz da árvore do diretório path, em *root (0 para o diretório raiz).
+ *  Retorna 0, com a mensagem, se ele não existe. Exige dir_lock. */
+int dir_resolve(rsfs_t *fs, char *path, unsigned int *root) {
+  char name[FS_NAMESIZE];
+  unsigned int parent;
+  dir_entry d;
+  int i, r;
+
+  for (*root = 0; *path == '/'; path++);
+  if (!*path)
+	return 1;
+  if (!path_parent(fs, path, &parent, name))
+	return 0;
+  if ((r = ent_find(fs, parent, name, &d, &i)) <= 0 || !(d.used & DE_DIR)) {
+	if (r >= 0)
+	  printf("Diretório não existe.\n");
+	return 0;
+  }
+  *root = d.first_block;
+  return 1;
+}
+
+int rsfs_mkdir(rsfs_t *fs, char *path) {
+  TIMED(FS_OP_MKDIR);
+  bnode_buf b;
+  char name[FS_NAMESIZE];
+  bnode *n = &b.n;
+  unsigned int parent, c = 0;
+  dir_entry d;
+  int i, r = -1;
+
+  dir_wrlock(fs);
+  if (!fs->formatado && printf(NFORMATADO)) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return 0;
+  }
+  if (nodes_ready(fs) && path_parent(fs, path, &parent, name) &&
+           (r = ent_find(fs, parent, name, &d, &i)) == 1)
+	printf("Arquivo já existente.\n");
+  else if (!r && !(c = node_alloc(fs, 0)))
+	printf("Não há espaço suficiente no disco.\n");
+
+  if (c) { /*  O diretório começa com uma folha vazia */
+	node_init(n, 0);
+	node_write(fs, c, n);
+	d.used = DE_USED | DE_DIR;
+	strcpy(d.name, name);
+	d.first_block = c;
+	d.size = 0;
+	if (!ent_add(fs, parent, &d, &i)) {
+	  node_free(fs, c);
+	  c = 0;
+	}
+  }
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  if (c)
+	fs_update(fs);
+  return c != 0;
+}
+
+int rsfs_rmdir(rsfs_t *fs, char *path) {
+  TIMED(FS_OP_RMDIR);
+  char name[FS_NAMESIZE];
+  unsigned int parent;
+  dir_entry d;
+  dir_entry_v2 e;
+  int i, r, id, ok = 0;
+
+  dir_wrlock(fs);
+  if (!fs->formatado && printf(NFORMATADO)) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return 0;
+  }
+  if (path_parent(fs, path, &parent, name) && (r = ent_find(fs, parent, name, &d, &i)) >= 0) {
+	if (!r || !(d.used & DE_DIR))
+	  printf(r ? "Não é um diretório.\n" : "Diretório não existe.\n");
+	else if (!nodes_ready(fs) || (r = bt_next(fs, d.first_block, "", &e)) == -1)
+	  ;
+	else if (r)
+	  printf("Diretório não vazio.\n");
+	else
+	  ok = 1;
+  }
+  if (ok)
+	ent_del(fs, parent, i, name);
+  pthread_rwlock_unlock(&fs->dir_lock);
+  if (!ok)
+	return 0;
+
+  /*  Os nós só são liberados fora de um commit, que ainda poderia gravar
+   *  algum deles no seu lugar depois de reusado */
+  pthread_mutex_lock(&fs->commit_lock);
+  id = commit_lead(fs);
+  pthread_mutex_unlock(&fs->commit_lock);
+  pthread_rwlock_wrlock(&fs->dir_lock);
+  bt_free(fs, d.first_block);
+  pthread_rwlock_unlock(&fs->dir_lock);
+  pthread_mutex_lock(&fs->commit_lock);
+  commit_done(fs, id);
+  pthread_mutex_unlock(&fs->commit_lock);
+
+  fs_update(fs);
+  return 1;
+}
+
+/*  Iterador de rsfs_opendir. Na raiz, pos é a próxima entrada de dir. Em
+ *  um subdiretório, leaf é a cópia da folha atual e pos a próxima entrada
+ *  dela; se dir_gen muda, o caminho é resolvido de novo e a busca
+ *  recomeça depois do último nome entregue. */
+struct rsfs_dir {
+  rsfs_t *fs;
+  char *path;
+  unsigned int root;
+  int pos, valid, done;
+  unsigned int gen;
+  char last[FS_NAMESIZE];
+  bnode_buf leaf;
+};
+
+rsfs_dir_t *rsfs_opendir(rsfs_t *fs, char *path) {
+  TIMED(FS_OP_LIST);
+  rsfs_dir_t *d;
+  unsigned int root;
+  int ok;
+
+  pthread_rwlock_rdlock(&fs->dir_lock);
+  if (!fs->formatado && printf(NFORMATADO))
+	ok = 0;
+  else
+	ok = dir_resolve(fs, path, &root);
+  pthread_rwlock_unlock(&fs->dir_lock);
+  if (!ok)
+	return NULL;
+
+  if ((d = calloc(1, sizeof(rsfs_dir_t))) == NULL || (d->path = strdup(path)) == NULL) {
+	free(d);
+	printf("Memória insuficiente para o iterador.\n");
+	return NULL;
+  }
+  d->fs = fs;
+  d->root = root;
+  return d;
+}
+
+/*  Próxima entrada do diretório, com o tipo (FS_FILE ou FS_DIR) em
+ *  *type. Os subdiretórios vêm em ordem de nome. Retorna 0 no fim. */
+int rsfs_dirnext(rsfs_dir_t *d, char *name, int *size, int *type) {
+  rsfs_t *fs = d->fs;
+  bnode *n = &d->leaf.n;
+  dir_entry_v2 *e;
+  int i, found = 0;
+
+  pthread_rwlock_rdlock(&fs->dir_lock);
+  if (!d->root) {
+	for (i = d->pos; i < DIRSIZE && !fs->dir[i].used; i++);
+	d->pos = i + 1;
+	if (i < DIRSIZE) {
+	  strcpy(name, fs->dir[i].name);
+	  *size = fs->dir[i].size;
+	  *type = fs->dir[i].used & DE_DIR ? FS_DIR : FS_FILE;
+	  found = 1;
+	}
+  } else if (!d->done) {
+	if (!d->valid || d->gen != fs->dir_gen) {
+	  d->valid = dir_resolve(fs, d->path, &d->root) && d->root &&
+	             bt_leaf(fs, d->root, d->last, n, &d->pos);
+	  d->gen = fs->dir_gen;
+	}
+	while (d->valid && d->pos >= n->count) {
+	  d->valid = n->next && node_read(fs, n->next, n);
+	  d->pos = 0;
+	}
+	if (d->valid) {
+	  e = n->e + d->pos++;
+	  memcpy(name, e->name, FS_NAMESIZE);
+	  memcpy(d->last, e->name, FS_NAMESIZE);
+	  *size = e->size;
+	  *type = e->used & DE_DIR ? FS_DIR : FS_FILE;
+	  found = 1;
+	} else
+	  d->done = 1;
+  }
+  pthread_rwlock_unlock(&fs->dir_lock);
+  return found;
+}
+
+void rsfs_closedir(rsfs_dir_t *d) {
+  if (d == NULL)
+	return;
+  free(d->path);
+  free(d);
+}
+
+int rsfs_open(rsfs_t *fs, char *file_name, int mode) {
+  TIMED(FS_OP_OPEN);
+  char name[FS_NAMESIZE];
+  unsigned int parent;
+  dir_entry d;
+  int i, r, fb, len, shared, entry, update = 0;
+  char *buffer;
+
+  if (mode != FS_R && mode != FS_W) {
+	printf("Erro ao abrir arquivo, modo não reconhecido.\n");
+	return -1;
+  }
+
+  if ((buffer = buffer_get(fs->csize)) == NULL)
+	return -1;
+
+  dir_wrlock(fs);
+
+  for (entry = 0; entry < MAXOPEN && fs->fildes[entry].opened; entry++);
+  r = -1;
+  if (entry == MAXOPEN)
+	printf("Arquivos abertos demais.\n");
+  else if (path_parent(fs, file_name, &parent, name))
+	r = ent_find(fs, parent, name, &d, &i); /*  Busca pelo arquivo */
+
+  if (r == -1)
+	entry = -1;
+  else if (r && d.used & DE_DIR) {
+	printf("É um diretório.\n");
+	entry = -1;
+  }
+  else if (r && fd_lookup(fs, parent, i, name) != -1) {
+	printf("Arquivo já aberto.\n");
+	entry = -1;
+  } 
+  else if (mode == FS_R) { /*  Modo de leitura */
+	if (!r) {
+      printf("Arquivo não existe.\n");
+	  entry = -1;
+	}
+  }
+  else if (!r) { /*  Escrita em arquivo que não existe */
+	if (!dir_create(fs, parent, name, &d, &i))
+	  entry = -1;
+	update = 1;
+  }
+  else { /*  Escrita em arquivo existente */
+	d.size = 0;
+	fb = d.first_block;
+	/*  Uma cadeia compartilhada fica com os clones, e o arquivo
+	 *  recomeça em uma só dele: a cópia na escrita não tem o que copiar,
+	 *  já que a escrita sempre trunca */
+	shared = !(d.used & DE_INLINE) && share_count(fs, fb);
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (!parent && fs->inline_size) { /*  Recomeça em inline_data, sem agrupamentos */
+	  if (!(d.used & DE_INLINE) && !shared)
+		chain_free(fs, fb);
+	  d.used = DE_USED | DE_INLINE;
+	  d.first_block = INLINE_BLOCK;
+	} else if (shared) {
+	  d.first_block = fs->free_count ? run_alloc(fs, 0, 1, &len) : 0;
+	} else if (fat_get(fs, fb) != 2) {
+	  chain_free(fs, fat_get(fs, fb));
+	  fat_set(fs, fb, 2);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (!d.first_block) {
+	  printf("Não há espaço suficiente no disco.\n");
+	  entry = -1;
+	} else {
+	  if (shared)
+		share_add(fs, fb, -1);
+	  ent_put(fs, parent, i, &d);
+	  update = 1;
+	}
+  }
+
+  if (entry == -1) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	buffer_put(buffer, fs->csize);
+	return -1;
+  }
+
+  pthread_mutex_lock(&fs->fildes[entry].lock);
+  fs->fildes[entry].opened = 1;
+  fs->fildes[entry].entry = i;
+  fs->fildes[entry].parent = parent;
+  strcpy(fs->fildes[entry].name, name);
+  fs->fildes[entry].buffer = buffer;
+  fs->fildes[entry].buffered = 0;
+  fs->fildes[entry].map = NULL;
+  fs->fildes[entry].map_len = fs->fildes[entry].map_cap = 0;
+  fs->fildes[entry].ra_window = 0;
+  fs->fildes[entry].ra_until = -1;
+  fs->fildes[entry].pos = 0;
+  fs->fildes[entry].size = d.size;
+  fs->fildes[entry].offset = 0;
+  fs->fildes[entry].current_block = d.first_block;
+  fs->fildes[entry].last_block = d.first_block;
+  fs->fildes[entry].first_block = d.first_block;
+  if (mode == FS_R && d.used & DE_INLINE) { /*  Nada a ler do disco */
+	memcpy(buffer, fs->inline_data + i * fs->inline_size, d.size);
+	fs->fildes[entry].buffered = INLINE_BLOCK;
+  }
+  fs->fildes[entry].reserved = 0;
+  fs->fildes[entry].compress = mode == FS_W && fs->zmap && fs->compress;
+  fs->fildes[entry].zbuffer = NULL;
+  fs->fildes[entry].mode = mode;
+  #ifdef DEBUG
+  printf("Primeiro bloco: %d\n", fs->fildes[entry].current_block);
+  #endif 
+  pthread_mutex_unlock(&fs->fildes[entry].lock);
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  if (update)
+	fs_update(fs);
+
+  return entry;
+}
+
+int rsfs_close(rsfs_t *fs, int file)  {
+  TIMED(FS_OP_CLOSE);
+  char *buffer, *zbuffer;
+  int mode;
+
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  if (!fs->fildes[file].current_block) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	printf("Arquivo não aberto.\n");
+	return -1;
+  }
+
+  mode = fs->fildes[file].mode;
+  if (mode == FS_W) {
+    /*  Ainda há coisas para serem escritas */
+    if (fs->fildes[file].offset && fs->fildes[file].current_block != INLINE_BLOCK &&
+        fs->fildes[file].buffered == fs->fildes[file].current_block)
+      flush_to_disk(fs, file, fs->fildes[file].current_block);
+
+    if (fs->fildes[file].reserved) { /*  Devolve a reserva não usada */
+      pthread_mutex_lock(&fs->alloc_lock);
+      chain_free(fs, fat_get(fs, fs->fildes[file].current_block));
+      fat_set(fs, fs->fildes[file].current_block, 2);
+      pthread_mutex_unlock(&fs->alloc_lock);
+      fs->fildes[file].reserved = 0;
+    }
+  }
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+
+  if (mode == FS_W) { /*  Publica o tamanho e grava dados e metadados */
+    dir_wrlock(fs);
+    writer_publish(fs, file);
+    pthread_rwlock_unlock(&fs->dir_lock);
+	
+    fs_update(fs);
+  } else
+    readahead_drain(fs, file);
+
+  /*  Só agora o arquivo pode ser reaberto: a escrita do último agrupamento
+   *  já terminou */
+  pthread_rwlock_wrlock(&fs->dir_lock);
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  buffer = fs->fildes[file].buffer;
+  zbuffer = fs->fildes[file].zbuffer;
+  fs->fildes[file].buffer = NULL;
+  fs->fildes[file].zbuffer = NULL;
+  free(fs->fildes[file].map);
+  fs->fildes[file].map = NULL;
+  fs->fildes[file].current_block = 0;
+  fs->fildes[file].opened = 0;
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  buffer_put(buffer, fs->csize);
+  if (zbuffer != NULL)
+    buffer_put(zbuffer, fs->csize);
+  return file; 
+}
+
+/*  Reserva agrupamentos contíguos para os próximos bytes bytes escritos
+ *  em file. A reserva não usada é devolvida em fs_close. */
+int rsfs_fallocate(rsfs_t *fs, int file, int bytes) {
+  TIMED(FS_OP_FALLOCATE);
+  int need, run, len, ok = 1;
+
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  if (!fs->fildes[file].current_block || fs->fildes[file].mode != FS_W) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	printf("Arquivo não aberto para escrita.\n");
+	return 0;
+  }
+
+  if (fs->fildes[file].current_block == INLINE_BLOCK) {
+	if (fs->fildes[file].offset + bytes <= fs->inline_size) {
+	  pthread_mutex_unlock(&fs->fildes[file].lock);
+	  return 1;
+	}
+	if (!chain_start(fs, file, fs->fildes[file].offset + bytes)) {
+	  pthread_mutex_unlock(&fs->fildes[file].lock);
+	  printf("Não há espaço suficiente no disco.\n");
+	  return 0;
+	}
+  }
+
+  need = (fs->fildes[file].offset + bytes + fs->csize - 1) / fs->csize - 1
+	- fs->fildes[file].reserved;
+  pthread_mutex_lock(&fs->alloc_lock);
+  if (need > fs->free_count) {
+	printf("Não há espaço suficiente no disco.\n");
+	ok = 0;
+  }
+  while (ok && need > 0) {
+	run = run_alloc(fs, fs->fildes[file].last_block + 1, need, &len);
+	fat_set(fs, fs->fildes[file].last_block, run);
+	fs->fildes[file].last_block = run + len - 1;
+	fs->fildes[file].reserved += len;
+	need -= len;
+  }
+  pthread_mutex_unlock(&fs->alloc_lock);
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+  return ok;
+}
+
+/*  Escreve agrupamentos inteiros de buffer direto no disco a partir de
+ *  current_block, que deve estar vazio, emendando em uma única escrita
+ *  cada trecho fisicamente contíguo da cadeia. Retorna os bytes escritos;
+ *  o descritor fica no fim do último agrupamento, sem nada em buffer. */
+int write_direct(rsfs_t *fs, char *buffer, int size, int file) {
+  unsigned int start, last, n;
+  int count, k;
+
+  start = last = fs->fildes[file].current_block;
+  count = 0;
+  k = 1;
+  while (1) {
+	cache_invalidate(fs->cache, last);
+	if (zsect_get(fs, last)) /*  O primeiro agrupamento de um arquivo reescrito */
+	  zsect_set(fs, last, 0);
+	size -= fs->csize;
+	if (size < fs->csize || !(n = next_block_w(fs, file, last, size)))
+	  break;
+	if (n != last + 1) { /*  Fim do trecho contíguo */
+	  bl_dev_submit_write(fs->dev, start * fs->spc, k * fs->spc, buffer + count);
+	  count += k * fs->csize;
+	  start = n;
+	  k = 0;
+	}
+	last = n;
+	k++;
+  }
+  bl_dev_submit_write(fs->dev, start * fs->spc, k * fs->spc, buffer + count);
+  count += k * fs->csize;
+  bl_wait();
+
+  fs->fildes[file].current_block = last;
+  fs->fildes[file].offset = fs->csize;
+  fs->fildes[file].buffered = 0;
+  return count;
+}
+
+int rsfs_write(rsfs_t *fs, char *buffer, int size, int file) {
+  TIMED(FS_OP_WRITE);
+  int write_count, n, inl, flushing = 0;
+  unsigned int cb;
+
+  #ifdef DEBUG
+  printf("Bloco atual: %d\n", fs->fildes[file].current_block);
+  #endif
+
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  if (!fs->fildes[file].current_block || fs->fildes[file].mode != FS_W) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+    printf("Arquivo não aberto para escrita.\n");
+	return 0;
+  }
+  /*  Cada agrupamento completado exige um novo, reservado ou livre, e um
+   *  arquivo que deixa de caber em inline_data exige o primeiro */
+  cb = fs->fildes[file].current_block;
+  inl = cb == INLINE_BLOCK && fs->fildes[file].offset + size > fs->inline_size;
+  pthread_mutex_lock(&fs->alloc_lock);
+  n = size > 0 && (fs->fildes[file].offset + size - 1) / fs->csize + inl >
+      fs->free_count + fs->fildes[file].reserved;
+  pthread_mutex_unlock(&fs->alloc_lock);
+  if (n || (inl && !(cb = chain_start(fs, file, fs->fildes[file].offset + size)))) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	printf("Não há espaço suficiente no disco.\n");
+	return 0;
+  }
+
+  write_count = 0;
+
+  while (size > 0) {
+	if (fs->fildes[file].offset == fs->csize) { /*  Agrupamento cheio */
+		if (!(n = next_block_w(fs, file, cb, size))) {
+			printf("Não há espaço suficiente no disco.\n");
+			break;
+		}
+		/*  A gravação do buffer fica em voo até ele ser reutilizado:
+		 *  junto com as de write_direct, se for o caso */
+		if (fs->fildes[file].buffered == cb) {
+			flush_to_disk(fs, file, cb);
+			flushing = 1;
+		}
+		cb = n;
+		fs->fildes[file].current_block = cb;
+		fs->fildes[file].offset = 0;
+	}
+
+	/*  Agrupamentos comprimidos passam um a um pelo buffer */
+	if (fs->fildes[file].offset == 0 && size >= fs->csize && !fs->fildes[file].compress) {
+		n = write_direct(fs, buffer + write_count, size, file);
+		flushing = 0;
+		cb = fs->fildes[file].current_block;
+		write_count += n;
+		size -= n;
+		continue;
+	}
+
+	if (flushing) {
+		bl_wait();
+		flushing = 0;
+	}
+	n = fs->csize - fs->fildes[file].offset;
+	if (n > size)
+		n = size;
+	memcpy(fs->fildes[file].buffer + fs->fildes[file].offset, buffer + write_count, n);
+	fs->fildes[file].buffered = cb;
+	fs->fildes[file].offset += n;
+	write_count += n;
+	size -= n;
+  }
+  if (flushing)
+	bl_wait();
+ 
+  /*  Atualização do arquivo */ 
+  fs->fildes[file].size += write_count;
+ 
+  #ifdef DEBUG 
+  printf("Tamanho: %d\n", fs->fildes[file].size);
+  #endif
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+
+  if (fs->durability == FS_SYNC_WRITE && write_count) {
+	dir_wrlock(fs);
+	writer_flush(fs, file);
+	pthread_rwlock_unlock(&fs->dir_lock);
+	fs_update(fs);
+  }
+
+  return write_count;
+}
+
+int rsfs_read(rsfs_t *fs, char *buffer, int size, int file) {
+  TIMED(FS_OP_READ);
+  int read_count, n, pending = 0, ok = 1;
+  int first_count = 0, first_offset = 0, first_pos = 0;
+  unsigned int cb, first_block = 0;
+
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  if (!fs->fildes[file].current_block || fs->fildes[file].mode != FS_R) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+    printf("Arquivo não aberto para leitura.\n");
+	return 0;
+  }
+
+  if (size > fs->fildes[file].size - fs->fildes[file].pos)
+	size = fs->fildes[file].size - fs->fildes[file].pos;
+
+  read_count = 0;
+  while (size > 0) {
+	if (fs->fildes[file].offset == fs->csize) { /*  Agrupamento consumido */
+		fs->fildes[file].current_block = fat_get(fs, fs->fildes[file].current_block);
+		fs->fildes[file].offset = 0;
+		if (size < fs->csize) /*  Só leituras pelo buffer usam a cache */
+			readahead(fs, file);
+	}
+	if (fs->fildes[file].offset == 0 && size >= fs->csize &&
+	    !zsect_get(fs, fs->fildes[file].current_block)) {
+		/*  Agrupamentos inteiros e contíguos vão direto para o usuário
+		 *  em uma leitura só; os comprimidos, pelo buffer. As leituras
+		 *  ficam em voo até o fim, ou até a espera de cluster_from_disk:
+		 *  em erro, o descritor volta para antes da primeira delas. */
+		cb = fs->fildes[file].current_block;
+		for (n = 1; (n + 1) * fs->csize <= size && fat_get(fs, cb + n - 1) == cb + n &&
+		     !zsect_get(fs, cb + n); n++);
+		if (!pending) {
+			pending = 1;
+			first_block = cb;
+			first_offset = fs->fildes[file].offset;
+			first_pos = fs->fildes[file].pos;
+			first_count = read_count;
+		}
+		bl_dev_submit_read(fs->dev, cb * fs->spc, n * fs->spc, buffer + read_count);
+		fs->fildes[file].current_block = cb + n - 1;
+		fs->fildes[file].offset = fs->csize;
+		fs->fildes[file].pos += n * fs->csize;
+		read_count += n * fs->csize;
+		size -= n * fs->csize;
+		continue;
+	}
+	if (fs->fildes[file].buffered != fs->fildes[file].current_block) {
+		n = cluster_from_disk(fs, fs->fildes[file].current_block, fs->fildes[file].buffer);
+		fs->fildes[file].buffered = fs->fildes[file].current_block;
+		if (pending && !n) {
+			ok = 0;
+			break;
+		}
+	}
+
+	n = fs->csize - fs->fildes[file].offset;
+	if (n > size)
+		n = size;
+	memcpy(buffer + read_count, fs->fildes[file].buffer + fs->fildes[file].offset, n);
+	fs->fildes[file].offset += n;
+	fs->fildes[file].pos += n;
+	read_count += n;
+	size -= n;
+  }
+  if (pending && (!ok || !bl_wait())) {
+	fs->fildes[file].current_block = first_block;
+	fs->fildes[file].offset = first_offset;
+	fs->fildes[file].pos = first_pos;
+	fs->fildes[file].buffered = 0;
+	read_count = first_count;
+  }
+
+  #ifdef DEBUG
+  printf("Cluster: %d\nOffset: %d\n", fs->fildes[file].current_block, fs->fildes[file].offset);
+  #endif
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+
+  return read_count;
+}
+
+/*  Agrupamento físico do agrupamento lógico n de file, estendendo o mapa
+ *  do descritor pela cadeia da FAT só até onde for preciso. Exige a trava
+ *  do descritor e n dentro do arquivo. */
+unsigned int logical_block(rsfs_t *fs, int file, int n) {
+  unsigned int *map;
+  int cap;
+
+  if (n >= fs->fildes[file].map_cap) {
+	for (cap = fs->fildes[file].map_cap ? fs->fildes[file].map_cap : 16; cap <= n; cap *= 2);
+	if ((map = realloc(fs->fildes[file].map, cap * sizeof(*map))) == NULL) {
+	  printf("Memória insuficiente para o mapa do arquivo.\n");
+	  return 0;
+	}
+	fs->fildes[file].map = map;
+	fs->fildes[file].map_cap = cap;
+  }
+  if (!fs->fildes[file].map_len)
+	fs->fildes[file].map[fs->fildes[file].map_len++] = fs->fildes[file].first_block;
+  while (fs->fildes[file].map_len <= n) {
+	fs->fildes[file].map[fs->fildes[file].map_len] =
+	  fat_get(fs, fs->fildes[file].map[fs->fildes[file].map_len - 1]);
+	fs->fildes[file].map_len++;
+  }
+  return fs->fildes[file].map[n];
+}
+
+/*  Posiciona a próxima leitura sequencial em offset */
+int rsfs_seek(rsfs_t *fs, int file, int offset) {
+  TIMED(FS_OP_SEEK);
+  unsigned int cb;
+  int n;
+
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  if (!fs->fildes[file].current_block || fs->fildes[file].mode != FS_R) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	printf("Arquivo não aberto para leitura.\n");
+	return -1;
+  }
+  if (offset < 0 || offset > fs->fildes[file].size) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	printf("Posição fora do arquivo.\n");
+	return -1;
+  }
+
+  /*  Uma posição no limite de um agrupamento fica no fim do anterior,
+   *  como deixaria a leitura sequencial */
+  n = offset / fs->csize;
+  if (offset % fs->csize == 0 && offset > 0)
+	n--;
+  if (!(cb = logical_block(fs, file, n))) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	return -1;
+  }
+  if (offset != fs->fildes[file].pos) { /*  Acesso aleatório encolhe a janela */
+	fs->fildes[file].ra_window /= 4;
+	fs->fildes[file].ra_until = -1;
+  }
+  fs->fildes[file].current_block = cb;
+  fs->fildes[file].offset = offset - n * fs->csize;
+  fs->fildes[file].pos = offset;
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+
+  return offset;
+}
+
+/*  Lê a partir de offset sem alterar a posição da leitura sequencial */
+int rsfs_pread(rsfs_t *fs, char *buffer, int size, int offset, int file) {
+  TIMED(FS_OP_PREAD);
+  unsigned int cb;
+  int read_count, n, off, pending = 0, ok = 1, first_count = 0;
+
+  pthread_mutex_lock(&fs->fildes[file].lock);
+  if (!fs->fildes[file].current_block || fs->fildes[file].mode != FS_R) {
+	pthread_mutex_unlock(&fs->fildes[file].lock);
+	printf("Arquivo não aberto para leitura.\n");
+	return 0;
+  }
+
+  if (offset < 0 || offset >= fs->fildes[file].size)
+	size = 0;
+  else if (size > fs->fildes[file].size - offset)
+	size = fs->fildes[file].size - offset;
+
+  read_count = 0;
+  while (size > 0) {
+	if (!(cb = logical_block(fs, file, offset / fs->csize)))
+	  break;
+	/*  Como em rsfs_read, agrupamentos inteiros e contíguos vão direto
+	 *  para o usuário, com as leituras em voo até o fim */
+	if (offset % fs->csize == 0 && size >= fs->csize && !zsect_get(fs, cb) &&
+	    fs->fildes[file].buffered != cb) {
+	  for (n = 1; (n + 1) * fs->csize <= size &&
+	       logical_block(fs, file, offset / fs->csize + n) == cb + n && !zsect_get(fs, cb + n); n++);
+	  if (!pending) {
+		pending = 1;
+		first_count = read_count;
+	  }
+	  bl_dev_submit_read(fs->dev, cb * fs->spc, n * fs->spc, buffer + read_count);
+	  offset += n * fs->csize;
+	  read_count += n * fs->csize;
+	  size -= n * fs->csize;
+	  continue;
+	}
+	if (fs->fildes[file].buffered != cb) {
+	  n = cluster_from_disk(fs, cb, fs->fildes[file].buffer);
+	  fs->fildes[file].buffered = cb;
+	  if (pending && !n) {
+		ok = 0;
+		break;
+	  }
+	}
+
+	off = offset % fs->csize;
+	n = fs->csize - off;
+	if (n > size)
+	  n = size;
+	memcpy(buffer + read_count, fs->fildes[file].buffer + off, n);
+	offset += n;
+	read_count += n;
+	size -= n;
+  }
+  if (pending && (!ok || !bl_wait())) {
+	fs->fildes[file].buffered = 0;
+	read_count = first_count;
+  }
+  pthread_mutex_unlock(&fs->fildes[file].lock);
+
+  return read_count;
+}
+
+/*  Copia src para dst dentro da imagem, em trechos de COPYSIZE bytes.
+ *  Os agrupamentos inteiros vão direto do disco para um buffer e dele
+ *  para o disco, em leituras e escritas dos trechos contíguos, e o
+ *  destino é reservado de uma vez. */
+int rsfs_copy(rsfs_t *fs, char *src, char *dst) {
+  TIMED(FS_OP_COPY);
+  char *buffer;
+  int in, out, n, ok;
+
+  if ((buffer = malloc(COPYSIZE)) == NULL) {
+	printf("Memória insuficiente para a cópia.\n");
+	return 0;
+  }
+  if ((in = rsfs_open(fs, src, FS_R)) == -1) {
+	free(buffer);
+	return 0;
+  }
+  if ((out = rsfs_open(fs, dst, FS_W)) == -1) {
+	rsfs_close(fs, in);
+	free(buffer);
+	return 0;
+  }
+
+  ok = !fs->fildes[in].size || rsfs_fallocate(fs, out, fs->fildes[in].size);
+  while (ok && (n = rsfs_read(fs, buffer, COPYSIZE, in)) > 0)
+	ok = rsfs_write(fs, buffer, n, out) == n;
+  rsfs_close(fs, in);
+  rsfs_close(fs, out);
+  free(buffer);
+  return ok;
+}
+
+/*  Faz de dst um clone de src: as duas entradas passam a usar a mesma
+ *  cadeia, sem copiar nada, até que uma delas seja reescrita. Arquivos em
+ *  inline_data são simplesmente copiados. */
+int rsfs_clone(rsfs_t *fs, char *src, char *dst) {
+  TIMED(FS_OP_CLONE);
+  char name[FS_NAMESIZE], dname[FS_NAMESIZE];
+  unsigned int parent, dparent;
+  dir_entry d, old;
+  int i, j, r, fd, ok = 0, copy = 0;
+
+  dir_wrlock(fs);
+  if (!fs->formatado && printf(NFORMATADO)) {
+	pthread_rwlock_unlock(&fs->dir_lock);
+	return 0;
+  }
+
+  if (!path_parent(fs, src, &parent, name) || (r = ent_find(fs, parent, name, &d, &i)) == -1)
+	;
+  else if (!r)
+	printf("Arquivo não existe.\n");
+  else if (d.used & DE_DIR)
+	printf("É um diretório.\n");
+  else if ((fd = fd_lookup(fs, parent, i, name)) != -1 && fs->fildes[fd].mode == FS_W)
+	printf("Arquivo aberto.\n");
+  else if (d.used & DE_INLINE)
+	copy = 1;
+  else if (fs->version == 1)
+	printf("Imagens antigas não têm clones.\n");
+  else if (!path_parent(fs, dst, &dparent, dname) ||
+           (r = ent_find(fs, dparent, dname, &old, &j)) == -1)
+	;
+  else if (r && old.used & DE_DIR)
+	printf("É um diretório.\n");
+  else if (r && fd_lookup(fs, dparent, j, dname) != -1)
+	printf("Arquivo aberto.\n");
+  else if (!r && !dparent && !fs->dir_nfree)
+	printf("Não há espaço no diretório.\n");
+  else if (share_add(fs, d.first_block, 1)) {
+	/*  A referência nova entra antes de dst soltar a sua cadeia, que
+	 *  pode ser a mesma */
+	strcpy(d.name, dname);
+	if (!r)
+	  ok = ent_add(fs, dparent, &d, &j);
+	else {
+	  if (!(old.used & DE_INLINE))
+		chain_release(fs, old.first_block);
+	  ent_put(fs, dparent, j, &d);
+	  ok = 1;
+	}
+	if (!ok)
+	  share_add(fs, d.first_block, -1);
+  }
+  pthread_rwlock_unlock(&fs->dir_lock);
+
+  if (copy)
+	return rsfs_copy(fs, src, dst);
+  if (ok)
+	fs_update(fs);
+  return ok;
+}
+
+void rsfs_stats(rsfs_t *fs, fs_counters *c) {
+  bl_stats disk;
+  cache_stats cache;
+  int i, b;
+
+  memset(&disk, 0, sizeof(disk));
+  memset(&cache, 0, sizeof(cache));
+  if (fs->dev != NULL)
+    bl_dev_get_stats(fs->dev, &disk);
+  if (fs->cache != NULL)
+    cache_get_stats(fs->cache, &cache);
+  c->sectors_read = disk.sectors_read;
+  c->sectors_written = disk.sectors_written;
+  c->requests = disk.requests;
+  c->seeks = disk.seeks;
+  c->syncs = disk.syncs;
+  c->updates = __atomic_load_n(&fs->counters.updates, __ATOMIC_RELAXED);
+  c->commits = __atomic_load_n(&fs->counters.commits, __ATOMIC_RELAXED);
+  c->metadata_bytes = __atomic_load_n(&fs->counters.metadata_bytes, __ATOMIC_RELAXED);
+  c->allocations = __atomic_load_n(&fs->counters.allocations, __ATOMIC_RELAXED);
+  c->alloc_scanned = __atomic_load_n(&fs->counters.alloc_scanned, __ATOMIC_RELAXED);
+  c->cluster_loads = __atomic_load_n(&fs->counters.cluster_loads, __ATOMIC_RELAXED);
+  c->readahead_clusters = __atomic_load_n(&fs->counters.readahead_clusters, __ATOMIC_RELAXED);
+  c->fat_loads = __atomic_load_n(&fs->counters.fat_loads, __ATOMIC_RELAXED);
+  c->node_loads = __atomic_load_n(&fs->counters.node_loads, __ATOMIC_RELAXED);
+  c->compressed = __atomic_load_n(&fs->counters.compressed, __ATOMIC_RELAXED);
+  c->cache_hits = cache.hits;
+  c->cache_misses = cache.misses;
+  c->cache_evictions = cache.evictions;
+  for (i = 0; i < FS_NOPS; i++) {
+    c->ops[i].count = __atomic_load_n(&fs->counters.ops[i].count, __ATOMIC_RELAXED);
+    c->ops[i].total_ns = __atomic_load_n(&fs->counters.ops[i].total_ns, __ATOMIC_RELAXED);
+    for (b = 0; b < FS_HIST_BUCKETS; b++)
+      c->ops[i].buckets[b] = __atomic_load_n(&fs->counters.ops[i].buckets[b], __ATOMIC_RELAXED);
+  }
+}
+
+/*  Zera os contadores; operações em andamento podem somar logo depois */
+void rsfs_stats_reset(rsfs_t *fs) {
+  unsigned long long *p = (unsigned long long *) &fs->counters;
+  int i;
+
+  for (i = 0; i < sizeof(fs->counters) / sizeof(*p); i++)
+    __atomic_store_n(p + i, 0, __ATOMIC_RELAXED);
+  if (fs->dev != NULL)
+    bl_dev_reset_stats(fs->dev);
+  if (fs->cache != NULL)
+    cache_reset_stats(fs->cache);
+}
+
+const char *fs_op_name(int op) {
+  return op >= 0 && op < FS_NOPS ? op_names[op] : "?";
+}
+
+/*  Monta a imagem path, criando-a com size setores se ela não existe */
+rsfs_t *rsfs_mount_mode(char *path, long long size, int mode) {
+  rsfs_t *fs;
+
+  if ((fs = calloc(1, sizeof(rsfs_t))) == NULL) {
+    printf("Memória insuficiente para montar a imagem.\n");
+    return NULL;
+  }
+  pthread_rwlock_init(&fs->dir_lock, NULL);
+  pthread_mutex_init(&fs->alloc_lock, NULL);
+  pthread_mutex_init(&fs->fat_lock, NULL);
+  pthread_mutex_init(&fs->node_lock, NULL);
+  pthread_mutex_init(&fs->commit_lock, NULL);
+  pthread_cond_init(&fs->commit_cond, NULL);
+  fs->cache_clusters = -1;
+  fs->durability = FS_SYNC_CLOSE;
+
+  if ((fs->dev = bl_dev_open(path, size, mode)) == NULL || !rsfs_init(fs)) {
+    fs->formatado = 0;
+    rsfs_unmount(fs);
+    return NULL;
+  }
+  return fs;
+}
+
+rsfs_t *rsfs_mount(char *path) {
+  return rsfs_mount_mode(path, 0, BL_PREAD);
+}
+
+/*  Desmontagem limpa, sem arquivos abertos: grava os metadados pendentes,
+ *  leva o journal aos lugares e deixa no superbloco o resumo que a
+ *  próxima montagem usa no lugar da FAT */
+int unmount_clean(rsfs_t *fs) {
+  int i, id;
+
+  for (i = 0; i < MAXOPEN; i++) {
+    if (fs->fildes[i].opened) {
+      printf("Imagem com arquivos abertos.\n");
+      return 0;
+    }
+  }
+  if (!fs->formatado || !fs->journaled || fs->version == 1)
+    return 1;
+
+  pthread_mutex_lock(&fs->commit_lock);
+  id = commit_lead(fs);
+  pthread_mutex_unlock(&fs->commit_lock);
+  bl_wait();
+  meta_commit(fs);
+  if (fs->clean_seq != fs->jseq || fs->jhead != 1) { /*  Senão, nada mudou */
+    checkpoint(fs);
+    super_write(fs, 1);
+    bl_dev_sync(fs->dev);
+  }
+  pthread_mutex_lock(&fs->commit_lock);
+  commit_done(fs, id);
+  pthread_mutex_unlock(&fs->commit_lock);
+  return 1;
+}
+
+/*  Desmonta a imagem, que não pode ter arquivos abertos */
+int rsfs_unmount(rsfs_t *fs) {
+  int i;
+
+  if (!unmount_clean(fs))
+    return 0;
+  if (fs->dev != NULL) {
+    bl_wait();
+    bl_dev_sync(fs->dev);
+    bl_dev_close(fs->dev);
+  }
+  cache_free(fs->cache);
+  free(fs->fat);
+  free(fs->zsect);
+  free(fs->fat_loaded);
+  free(fs->free_map);
+  free(fs->fat_dirty);
+  free(fs->dir_dirty);
+  free(fs->inline_data);
+  free(fs->stage);
+  free(fs->marked);
+  free(fs->home_dirty);
+  free(fs->jstage);
+  free(fs->node_data);
+  for (i = 0; i < MAXOPEN; i++)
+    pthread_mutex_destroy(&fs->fildes[i].lock);
+  pthread_cond_destroy(&fs->commit_cond);
+  pthread_mutex_destroy(&fs->commit_lock);
+  pthread_mutex_destroy(&fs->alloc_lock);
+  pthread_mutex_destroy(&fs->fat_lock);
+  pthread_mutex_destroy(&fs->node_lock);
+  pthread_rwlock_destroy(&fs->dir_lock);
+  free(fs);
+  return 1;
+}
+
+
+/*  Interface original, sobre default_fs. fs_init e fs_format (que pode
+ *  vir antes) tomam o dispositivo aberto por bl_init. */
+
+int fs_init() {
+  default_fs->dev = bl_default();
+  return rsfs_init(default_fs);
+}
+
+/*  Desmontagem limpa da imagem de fs_init; o dispositivo continua aberto */
+int fs_unmount() {
+  return unmount_clean(default_fs);
+}
+
+int fs_format() {
+  default_fs->dev = bl_default();
+  return rsfs_format(default_fs);
+}
+
+int fs_format_geometry(int cluster_size, int fat_bits) {
+  default_fs->dev = bl_default();
+  return rsfs_format_geometry(default_fs, cluster_size, fat_bits);
+}
+
+int fs_cache_size(int nclusters) {
+  return rsfs_cache_size(default_fs, nclusters);
+}
+
+int fs_durability(int mode) {
+  return rsfs_durability(default_fs, mode);
+}
+
+int fs_compression(int on) {
+  return rsfs_compression(default_fs, on);
+}
+
+int fs_compress(int file, int on) {
+  return rsfs_compress(default_fs, file, on);
+}
+
+int fs_sync() {
+  return rsfs_sync(default_fs);
+}
+
+long long fs_free() {
+  return rsfs_free(default_fs);
+}
+
+int fs_list(char *buffer, int size) {
+  return rsfs_list(default_fs, buffer, size);
+}
+
+int fs_readdir(int *pos, char *name, int *size) {
+  return rsfs_readdir(default_fs, pos, name, size);
+}
+
+rsfs_dir_t *fs_opendir(char *path) {
+  return rsfs_opendir(default_fs, path);
+}
+
+int fs_dirnext(rsfs_dir_t *d, char *name, int *size, int *type) {
+  return rsfs_dirnext(d, name, size, type);
+}
+
+void fs_closedir(rsfs_dir_t *d) {
+  rsfs_closedir(d);
+}
+
+int fs_batch(int on) {
+  return rsfs_batch(default_fs, on);
+}
+
+int fs_create(char *file_name) {
+  return rsfs_create(default_fs, file_name);
+}
+
+int fs_remove(char *file_name) {
+  return rsfs_remove(default_fs, file_name);
+}
+
+int fs_mkdir(char *path) {
+  return rsfs_mkdir(default_fs, path);
+}
+
+int fs_rmdir(char *path) {
+  return rsfs_rmdir(default_fs, path);
+}
+
+int fs_open(char *file_name, int mode) {
+  return rsfs_open(default_fs, file_name, mode);
+}
+
+int fs_close(int file) {
+  return rsfs_close(default_fs, file);
+}
+
+int fs_copy(char *src, char *dst) {
+  return rsfs_copy(default_fs, src, dst);
+}
+
+int fs_clone(char *src, char *dst) {
+  return rsfs_clone(default_fs, src, dst);
+}
+
+int fs_fallocate(int file, int bytes) {
+  return rsfs_fallocate(default_fs, file, bytes);
+}
+
+int fs_write(char *buffer, int size, int file) {
+  return rsfs_write(default_fs, buffer, size, file);
+}
+
+int fs_read(char *buffer, int size, int file) {
+  return rsfs_read(default_fs, buffer, size, file);
+}
+
+int fs_seek(int file, int offset) {
+  return rsfs_seek(default_fs, file, offset);
+}
+
+int fs_pread(char *buffer, int size, int offset, int file) {
+  return rsfs_pread(default_fs, buffer, size, offset, file);
+}
+
+void fs_stats(fs_counters *counters) {
+  rsfs_stats(default_fs, counters);
+}
+
+void fs_stats_reset() {
+  rsfs_stats_reset(default_fs);
+}
@@ -23,13 +23,139 @@
 #define FS_R 0
 #define FS_W 1
 
+#define FS_NAMESIZE 25 /*  Nomes têm até FS_NAMESIZE - 1 caracteres */
+
+/*  Tipos de entrada de fs_dirnext */
+#define FS_FILE 0
+#define FS_DIR 1
+
+/*  Durabilidade: fdatasync só em fs_sync (e na saída), também em cada
+ *  fs_close e operação de metadados, ou também em cada fs_write */
+#define FS_SYNC_NONE 0
+#define FS_SYNC_CLOSE 1
+#define FS_SYNC_WRITE 2
+
+/*  Operações com histograma de latência em fs_counters */
+#define FS_OP_FORMAT 0
+#define FS_OP_LIST 1
+#define FS_OP_CREATE 2
+#define FS_OP_REMOVE 3
+#define FS_OP_OPEN 4
+#define FS_OP_CLOSE 5
+#define FS_OP_FALLOCATE 6
+#define FS_OP_WRITE 7
+#define FS_OP_READ 8
+#define FS_OP_SEEK 9
+#define FS_OP_PREAD 10
+#define FS_OP_SYNC 11
+#define FS_OP_MKDIR 12
+#define FS_OP_RMDIR 13
+#define FS_OP_COPY 14
+#define FS_OP_CLONE 15
+#define FS_NOPS 16
+#define FS_HIST_BUCKETS 32
+
+typedef struct {
+  unsigned long long count;
+  unsigned long long total_ns;
+  unsigned long long buckets[FS_HIST_BUCKETS]; /*  i: menos de 2^i ns */
+} fs_histogram;
+
+typedef struct {
+  /*  Dispositivo */
+  unsigned long long sectors_read, sectors_written, requests, seeks, syncs;
+  /*  Metadados: chamadas a fs_update, commits feitos e bytes gravados */
+  unsigned long long updates, commits, metadata_bytes;
+  /*  Alocação: trechos alocados e agrupamentos percorridos procurando */
+  unsigned long long allocations, alloc_scanned;
+  /*  Agrupamentos carregados em buffers e pedidos ao read-ahead */
+  unsigned long long cluster_loads, readahead_clusters;
+  /*  Setores da FAT lidos sob demanda depois de uma montagem rápida */
+  unsigned long long fat_loads;
+  /*  Nós de subdiretório lidos do disco (fora da cache de nós) */
+  unsigned long long node_loads;
+  /*  Agrupamentos gravados comprimidos */
+  unsigned long long compressed;
+  unsigned long long cache_hits, cache_misses, cache_evictions;
+  fs_histogram ops[FS_NOPS];
+} fs_counters;
+
+/*  Interface com handle: cada imagem montada é independente e pode ser
+ *  usada por threads próprias. */
+typedef struct rsfs rsfs_t;
+
+/*  Iterador de diretório: entrega uma entrada por vez, sem limite de
+ *  tamanho, e tolera alterações do diretório durante a listagem */
+typedef struct rsfs_dir rsfs_dir_t;
+
+rsfs_t *rsfs_mount(char *path);
+rsfs_t *rsfs_mount_mode(char *path, long long size, int mode);
+int rsfs_unmount(rsfs_t *fs);
+int rsfs_init(rsfs_t *fs);
+int rsfs_format(rsfs_t *fs);
+int rsfs_format_geometry(rsfs_t *fs, int cluster_size, int fat_bits);
+int rsfs_cache_size(rsfs_t *fs, int nclusters);
+int rsfs_durability(rsfs_t *fs, int mode);
+int rsfs_compression(rsfs_t *fs, int on);
+int rsfs_sync(rsfs_t *fs);
+long long rsfs_free(rsfs_t *fs);
+int rsfs_list(rsfs_t *fs, char *buffer, int size);
+int rsfs_readdir(rsfs_t *fs, int *pos, char *name, int *size);
+rsfs_dir_t *rsfs_opendir(rsfs_t *fs, char *path);
+int rsfs_dirnext(rsfs_dir_t *d, char *name, int *size, int *type);
+void rsfs_closedir(rsfs_dir_t *d);
+int rsfs_mkdir(rsfs_t *fs, char *path);
+int rsfs_rmdir(rsfs_t *fs, char *path);
+int rsfs_batch(rsfs_t *fs, int on);
+int rsfs_create(rsfs_t *fs, char *file_name);
+int rsfs_remove(rsfs_t *fs, char *file_name);
+int rsfs_open(rsfs_t *fs, char *file_name, int mode);
+int rsfs_close(rsfs_t *fs, int file);
+int rsfs_compress(rsfs_t *fs, int file, int on);
+int rsfs_copy(rsfs_t *fs, char *src, char *dst);
+int rsfs_clone(rsfs_t *fs, char *src, char *dst);
+int rsfs_fallocate(rsfs_t *fs, int file, int bytes);
+int rsfs_write(rsfs_t *fs, char *buffer, int size, int file);
+int rsfs_read(rsfs_t *fs, char *buffer, int size, int file);
+int rsfs_seek(rsfs_t *fs, int file, int offset);
+int rsfs_pread(rsfs_t *fs, char *buffer, int size, int offset, int file);
+void rsfs_stats(rsfs_t *fs, fs_counters *counters);
+void rsfs_stats_reset(rsfs_t *fs);
+
+/*  Interface original, sobre a imagem do dispositivo aberto por bl_init */
 int fs_init();
+int fs_unmount();
 int fs_format();
-int fs_free();
+int fs_format_geometry(int cluster_size, int fat_bits);
+int fs_cache_size(int nclusters);
+int fs_durability(int mode);
+int fs_compression(int on);
+int fs_sync();
+long long fs_free();
 int fs_list(char *buffer, int size);
+int fs_readdir(int *pos, char *name, int *size);
+rsfs_dir_t *fs_opendir(char *path);
+int fs_dirnext(rsfs_dir_t *d, char *name, int *size, int *type);
+void fs_closedir(rsfs_dir_t *d);
+int fs_mkdir(char *path);
+int fs_rmdir(char *path);
+int fs_batch(int on);
+/*  Mudança da interface: fs_create retorna -1 em qualquer erro, e não
+ *  mais 0 quando falta espaço ou o nome é longo demais, e recusa nomes
+ *  de FS_NAMESIZE caracteres ou mais, que antes transbordavam a entrada.
+ *  Em sucesso, a entrada do diretório raiz, ou 0 em um subdiretório. */
 int fs_create(char *file_name);
 int fs_remove(char *file_name);
 int fs_open(char *file_name, int mode);
 int fs_close(int file);
+int fs_compress(int file, int on);
+int fs_copy(char *src, char *dst);
+int fs_clone(char *src, char *dst);
+int fs_fallocate(int file, int bytes);
 int fs_write(char *buffer, int size, int file);
 int fs_read(char *buffer, int size, int file);
+int fs_seek(int file, int offset);
+int fs_pread(char *buffer, int size, int offset, int file);
+void fs_stats(fs_counters *counters);
+void fs_stats_reset();
+const char *fs_op_name(int op);
@@ -0,0 +1,177 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "lz.h"
+
+/*  Cada sequência é um byte de controle, com o tamanho dos literais nos
+ *  4 bits altos e o da cópia menos LZ_MINMATCH nos baixos (15: continua
+ *  em bytes seguintes, somados até um que não seja 255), os literais, a
+ *  distância da cópia em 2 bytes (little-endian) e o resto do tamanho
+ *  dela. A última sequência só tem literais. */
+
+#define LZ_MINMATCH 4
+#define LZ_HASHBITS 12
+#define LZ_SKIP 6 /*  Sem achar cópias, o passo cresce a cada 2^LZ_SKIP bytes */
+
+unsigned int lz_read32(char *p) {
+  unsigned int v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+unsigned int lz_hash(unsigned int v) {
+  return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+/*  Grava o tamanho n a partir do byte de controle *token, no nibble de
+ *  shift. Retorna o fim da saída, ou NULL se ela passa de end. */
+char *lz_length(char *op, char *end, unsigned char *token, int shift, int n) {
+  if (n < 15) {
+    *token |= n << shift;
+    return op;
+  }
+  *token |= 15 << shift;
+  for (n -= 15; ; n -= 255) {
+    if (op == end)
+      return NULL;
+    *op++ = n < 255 ? n : 255;
+    if (n < 255)
+      return op;
+  }
+}
+
+/*  Grava os literais de in[0..lit) e, se len > 0, uma cópia de len
+ *  bytes a dist bytes para trás */
+char *lz_sequence(char *op, char *end, char *in, int lit, int dist, int len) {
+  unsigned char *token;
+
+  if (op == end)
+    return NULL;
+  token = (unsigned char *) op++;
+  *token = 0;
+  if ((op = lz_length(op, end, token, 4, lit)) == NULL || end - op < lit)
+    return NULL;
+  memcpy(op, in, lit);
+  op += lit;
+  if (!len)
+    return op;
+  if (end - op < 2)
+    return NULL;
+  *op++ = dist & 0xff;
+  *op++ = dist >> 8;
+  return lz_length(op, end, token, 0, len - LZ_MINMATCH);
+}
+
+/*  Comprime os size bytes de in em out. Retorna o tamanho comprimido, ou
+ *  0 se ele não cabe em max bytes. */
+int lz_compress(char *in, int size, char *out, int max) {
+  unsigned short table[1 << LZ_HASHBITS];
+  char *op = out, *end = out + max;
+  int ip, anchor, ref, len, h;
+  unsigned int v;
+
+  if (size > LZ_MAXBLOCK)
+    return 0;
+  memset(table, 0, sizeof(table));
+  ip = anchor = 0;
+  while (ip + LZ_MINMATCH <= size) {
+    v = lz_read32(in + ip);
+    h = lz_hash(v);
+    ref = table[h];
+    table[h] = ip;
+    if (ref >= ip || lz_read32(in + ref) != v) {
+      ip += 1 + ((ip - anchor) >> LZ_SKIP);
+      continue;
+    }
+    for (len = LZ_MINMATCH; ip + len < size && in[ref + len] == in[ip + len]; len++);
+    if ((op = lz_sequence(op, end, in + anchor, ip - anchor, ip - ref, len)) == NULL)
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+  if ((op = lz_sequence(op, end, in + anchor, size - anchor, 0, 0)) == NULL)
+    return 0;
+  return op - out;
+}
+
+/*  Lê o resto de um tamanho que não coube no nibble. Retorna -1 se a
+ *  entrada acaba antes. */
+int lz_more(unsigned char **ip, unsigned char *end) {
+  int n = 0, b;
+
+  do {
+    if (*ip == end)
+      return -1;
+    b = *(*ip)++;
+    n += b;
+  } while (b == 255);
+  return n;
+}
+
+/*  Descomprime os size bytes de in em out, que tem max bytes. Retorna o
+ *  tamanho descomprimido, ou -1 se a entrada está corrompida. */
+int lz_decompress(char *in, int size, char *out, int max) {
+  unsigned char *ip = (unsigned char *) in, *end = ip + size;
+  char *op = out, *oend = out + max;
+  int token, lit, len, dist, n;
+
+  while (ip < end) {
+    token = *ip++;
+    lit = token >> 4;
+    if (lit == 15) {
+      if ((n = lz_more(&ip, end)) == -1)
+        return -1;
+      lit += n;
+    }
+    if (lit > end - ip || lit > oend - op)
+      return -1;
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == end) /*  Última sequência */
+      break;
+
+    if (end - ip < 2)
+      return -1;
+    dist = ip[0] | ip[1] << 8;
+    ip += 2;
+    len = token & 15;
+    if (len == 15) {
+      if ((n = lz_more(&ip, end)) == -1)
+        return -1;
+      len += n;
+    }
+    len += LZ_MINMATCH;
+    if (!dist || dist > op - out || len > oend - op)
+      return -1;
+    if (dist >= len) {
+      memcpy(op, op - dist, len);
+      op += len;
+    } else /*  A cópia repete o que ela mesma escreve */
+      for (; len; len--, op++)
+        *op = op[-dist];
+  }
+  return op - out;
+}
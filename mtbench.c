@@ -0,0 +1,163 @@
+/*
+ * RSFS - Really Simple File System
+ *
+ * Copyright © 2010,2011 Gustavo Maciel Dias Vieira
+ * Copyright © 2010 Rodrigo Rocco Barbieri
+ *
+ * This file is part of RSFS.
+ *
+ * RSFS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark multithread: cada thread grava e depois lê de volta o seu
+ * próprio arquivo, para 1, 2, 4, ... threads, e mede a vazão agregada.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define CHUNK (64 * 1024)
+#define MAX_THREADS 64
+
+int file_size;
+int errors;
+pthread_barrier_t barrier;
+
+double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *writer(void *arg) {
+  char name[32], *buffer;
+  int fd, done, n;
+
+  buffer = malloc(CHUNK);
+  memset(buffer, 'a' + (long) arg % 26, CHUNK);
+  sprintf(name, "t%ld", (long) arg);
+  pthread_barrier_wait(&barrier);
+
+  if ((fd = fs_open(name, FS_W)) == -1) {
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    free(buffer);
+    return NULL;
+  }
+  for (done = 0; done < file_size; done += n) {
+    n = file_size - done < CHUNK ? file_size - done : CHUNK;
+    if (fs_write(buffer, n, fd) != n) {
+      __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  fs_close(fd);
+  free(buffer);
+  return NULL;
+}
+
+void *reader(void *arg) {
+  char name[32], *buffer;
+  int fd, total, n, i;
+
+  buffer = malloc(CHUNK);
+  sprintf(name, "t%ld", (long) arg);
+  pthread_barrier_wait(&barrier);
+
+  if ((fd = fs_open(name, FS_R)) == -1) {
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    free(buffer);
+    return NULL;
+  }
+  total = 0;
+  while ((n = fs_read(buffer, CHUNK, fd)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (buffer[i] != 'a' + (long) arg % 26) {
+        __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+        break;
+      }
+    }
+    total += n;
+  }
+  if (total != file_size)
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+  fs_close(fd);
+  free(buffer);
+  return NULL;
+}
+
+double run(int nthreads, void *(*fn)(void *)) {
+  pthread_t threads[MAX_THREADS];
+  double start;
+  long i;
+
+  pthread_barrier_init(&barrier, NULL, nthreads + 1);
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, fn, (void *) i);
+  pthread_barrier_wait(&barrier);
+  start = now();
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  pthread_barrier_destroy(&barrier);
+  return now() - start;
+}
+
+int main(int argc, char **argv) {
+  char *image = "/tmp/rsfs-mtbench.img";
+  int mb = 16, max_threads = 8, n;
+  double tw, tr, total;
+
+  if (argc > 1)
+    mb = atoi(argv[1]);
+  if (argc > 2)
+    max_threads = atoi(argv[2]);
+  if (argc > 3)
+    image = argv[3];
+  if (mb < 1 || max_threads < 1 || max_threads > MAX_THREADS) {
+    printf("Uso: %s [MB por thread] [máximo de threads] [imagem]\n", argv[0]);
+    exit(0);
+  }
+  file_size = mb * 1024 * 1024;
+
+  unlink(image);
+  if (!bl_init(image, (max_threads * mb + 8) * 2048LL) || !fs_init()) {
+    exit(1);
+  }
+
+  printf("%d MB por thread, %ld processadores\n", mb, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("threads\tescrita MB/s\tleitura MB/s\n");
+  for (n = 1; n <= max_threads; n *= 2) {
+    fs_format();
+    fs_cache_size(0); /*  Leituras vêm do dispositivo, não da cache */
+    tw = run(n, writer);
+    tr = run(n, reader);
+    total = (double) n * mb;
+    printf("%d\t%.1f\t\t%.1f\n", n, total / tw, total / tr);
+  }
+
+  unlink(image);
+  if (errors) {
+    printf("%d erros.\n", errors);
+    return 1;
+  }
+  return 0;
+}
@@ -20,9 +20,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "disk.h"
 #include "fs.h"
@@ -30,28 +34,38 @@
 #define MAX_STR 256
 #define MAX_ARG 32
 #define COPY_BUFFER_SIZE 10
+#define CHUNK_SIZE (1024 * 1024) /*  Pedaços de importdir/exportdir */
+#define NCHUNKS 2
 
-void format();
-void list();
+void format(int cluster_size, int fat_bits);
+void list(char *dir);
 void create(char *file);
 void fremove(char *file);
+void makedir(char *dir);
+void removedir(char *dir);
 void copy(char *file1, char *file2);
+void fclone(char *file1, char *file2);
 void copyf(char *file1, char *file2);
 void copyt(char *file1, char *file2);
+void show_stats(FILE *out, int json);
+void quit();
+void importdir(char *dir);
+void exportdir(char *dir);
 
 int main(int argc, char **argv) {
   char *image;
-  int size;
+  long long size;
   char linha[MAX_STR];
   char *args[MAX_ARG + 1];
   char *token;
-  int i, tam;
+  char *backend, *sync;
+  int i, tam, mode;
 
   size = -1;
   if (argc >= 2 && argc <= 3) {
     image = argv[1];
     if (argc > 2) {
-      size = atoi(argv[2]) * 2048; /* Cada MB tem 2048 setores. */
+      size = atoll(argv[2]) * 2048; /* Cada MB tem 2048 setores. */
     }
   } else {
     printf("Uso: %s imagem [tamanho]\n", argv[0]);
@@ -60,20 +74,41 @@ int main(int argc, char **argv) {
     exit(0);
   }
 
-  if (!bl_init(image, size)) {
+  mode = BL_PREAD;
+  backend = getenv("RSFS_BACKEND");
+  if (backend != NULL && !strcmp(backend, "mmap")) {
+    mode = BL_MMAP;
+  } else if (backend != NULL && !strcmp(backend, "uring")) {
+    mode = BL_URING;
+  }
+
+  if (!bl_init_mode(image, size, mode)) {
     exit(0);
   }
   printf("Arquivo de imagem %s aberto.\n", image);
-  printf("Tamanho %d setores (%d bytes).\n", bl_size(), bl_size() * SECTORSIZE);
+  printf("Tamanho %lld setores (%lld bytes).\n", bl_size(), bl_size() * SECTORSIZE);
   
+  if (getenv("RSFS_CACHE") != NULL) {
+    fs_cache_size(atoi(getenv("RSFS_CACHE")));
+  }
+
+  sync = getenv("RSFS_SYNC");
+  if (sync != NULL && !strcmp(sync, "none")) {
+    fs_durability(FS_SYNC_NONE);
+  } else if (sync != NULL && !strcmp(sync, "write")) {
+    fs_durability(FS_SYNC_WRITE);
+  }
+
   if (!fs_init()) {
     exit(0);
   }
 
   while (1) {
     printf("> ");
-    linha[0] = '\0';
-    fgets(linha, MAX_STR, stdin);
+    if (fgets(linha, MAX_STR, stdin) == NULL) { /*  Fim da entrada: como exit */
+      printf("\n");
+      quit();
+    }
     tam = strlen(linha);
     if (tam > 0 && linha[tam - 1] == '\n') {
       linha[tam - 1] = '\0';
@@ -93,11 +128,59 @@ int main(int argc, char **argv) {
     }
 
     if (!strcmp(args[0], "exit")) {
-      exit(EXIT_SUCCESS);
+      quit();
+    } else if (!strcmp(args[0], "importdir")) {
+      if (i == 2) {
+	importdir(args[1]);
+      } else {
+	printf("Uso: importdir <real_dir>\n");
+      }
+    } else if (!strcmp(args[0], "exportdir")) {
+      if (i == 2) {
+	exportdir(args[1]);
+      } else {
+	printf("Uso: exportdir <real_dir>\n");
+      }
+    } else if (!strcmp(args[0], "stats")) {
+      if (i == 2 && !strcmp(args[1], "reset")) {
+        fs_stats_reset();
+      } else if (i == 1) {
+        show_stats(stdout, 0);
+      } else {
+        printf("Uso: stats [reset]\n");
+      }
+    } else if (!strcmp(args[0], "sync")) {
+      fs_sync();
+    } else if (!strcmp(args[0], "compress")) {
+      if (i == 2 && (!strcmp(args[1], "on") || !strcmp(args[1], "off"))) {
+        fs_compression(!strcmp(args[1], "on"));
+      } else {
+        printf("Uso: compress <on|off>\n");
+      }
     } else if (!strcmp(args[0], "format")) {
-      format();
+      if (i <= 3) {
+	format(i > 1 ? atoi(args[1]) : 4096, i > 2 ? atoi(args[2]) : 0);
+      } else {
+	printf("Uso: format [tamanho do agrupamento] [16|32]\n");
+      }
     } else if (!strcmp(args[0], "list")) {
-      list();
+      if (i <= 2) {
+	list(i == 2 ? args[1] : "/");
+      } else {
+	printf("Uso: list [dir]\n");
+      }
+    } else if (!strcmp(args[0], "mkdir")) {
+      if (i == 2) {
+	makedir(args[1]);
+      } else {
+	printf("Uso: mkdir <dir>\n");
+      }
+    } else if (!strcmp(args[0], "rmdir")) {
+      if (i == 2) {
+	removedir(args[1]);
+      } else {
+	printf("Uso: rmdir <dir>\n");
+      }
     } else if (!strcmp(args[0], "create")) {
       if (i == 2) {
 	create(args[1]);
@@ -116,6 +199,12 @@ int main(int argc, char **argv) {
       } else {
 	printf("Uso: copy <file1> <file2>\n");
       }
+    } else if (!strcmp(args[0], "clone")) {
+      if (i == 3) {
+	fclone(args[1], args[2]);
+      } else {
+	printf("Uso: clone <file1> <file2>\n");
+      }
     } else if (!strcmp(args[0], "copyf")) {
       if (i == 3) {
 	copyf(args[1], args[2]);
@@ -134,18 +223,29 @@ int main(int argc, char **argv) {
   }
 }
 
-void format() {
-  if (fs_format()) {
-    printf("Formatação concluída. %d bytes livres.\n", fs_free());
+void format(int cluster_size, int fat_bits) {
+  if (fs_format_geometry(cluster_size, fat_bits)) {
+    printf("Formatação concluída. %lld bytes livres.\n", fs_free());
   }
 }
 
-void list() {
-  char buffer[4096];
-  if (fs_list(buffer, 4096)) {
-    printf("%s", buffer);
-    printf("%d bytes livres.\n", fs_free());
+void list(char *dir) {
+  char name[FS_NAMESIZE];
+  rsfs_dir_t *d;
+  int size, type;
+
+  if ((d = fs_opendir(dir)) == NULL) {
+    return;
   }
+  while (fs_dirnext(d, name, &size, &type)) {
+    if (type == FS_DIR) {
+      printf("%s/\n", name);
+    } else {
+      printf("%s\t\t%d\n", name, size);
+    }
+  }
+  fs_closedir(d);
+  printf("%lld bytes livres.\n", fs_free());
 }
 
 void create(char *file) {
@@ -156,29 +256,20 @@ void fremove(char *file) {
   fs_remove(file);
 }
 
-void copy(char *file1, char *file2) {
-  int fd1, fd2;
-  char buffer[COPY_BUFFER_SIZE];
-  int read;
+void makedir(char *dir) {
+  fs_mkdir(dir);
+}
 
-  if ((fd1 = fs_open(file1, FS_R)) == -1) {
-    return;
-  }
+void removedir(char *dir) {
+  fs_rmdir(dir);
+}
 
-  if ((fd2 = fs_open(file2, FS_W)) == -1) {
-    fs_close(fd1);
-    return;
-  }
-  while ((read = fs_read(buffer, COPY_BUFFER_SIZE, fd1)) > 0) {
-    if (fs_write(buffer, read, fd2) != read) {
-      fs_close(fd1);
-      fs_close(fd2);
-      return;
-    }
-  }
+void copy(char *file1, char *file2) {
+  fs_copy(file1, file2);
+}
 
-  fs_close(fd1);
-  fs_close(fd2);
+void fclone(char *file1, char *file2) {
+  fs_clone(file1, file2);
 }
 
 void copyf(char *file1, char *file2) {
@@ -239,3 +330,348 @@ void copyt(char *file1, char *file2) {
   fs_close(fd1);
   fclose(stream);
 }
+
+/*  Desmonta, grava os contadores em RSFS_STATS e termina */
+void quit() {
+  char *dump;
+  FILE *stream;
+
+  fs_unmount(); /*  Com arquivos abertos, a próxima montagem lê a FAT toda */
+  bl_sync();
+  dump = getenv("RSFS_STATS"); /*  Arquivo para os contadores em JSON */
+  if (dump != NULL && !strcmp(dump, "-")) {
+    show_stats(stdout, 1);
+  } else if (dump != NULL) {
+    if ((stream = fopen(dump, "w")) == NULL) {
+      perror("Abrindo arquivo de estatísticas");
+    } else {
+      show_stats(stream, 1);
+      fclose(stream);
+    }
+  }
+  exit(EXIT_SUCCESS);
+}
+
+/*  Limite superior, em ns, do percentil p de um histograma */
+double hist_percentile(fs_histogram *h, double p) {
+  unsigned long long seen = 0;
+  int b;
+
+  for (b = 0; b < FS_HIST_BUCKETS - 1; b++) {
+    seen += h->buckets[b];
+    if (seen >= p * h->count)
+      break;
+  }
+  return (double) (1ULL << b);
+}
+
+void show_stats(FILE *out, int json) {
+  fs_counters c;
+  fs_histogram *h;
+  int i, b;
+
+  fs_stats(&c);
+  if (!json) {
+    fprintf(out, "Setores lidos: %llu, escritos: %llu\n", c.sectors_read, c.sectors_written);
+    fprintf(out, "Requisições: %llu, seeks: %llu, syncs: %llu\n", c.requests, c.seeks, c.syncs);
+    fprintf(out, "fs_update: %llu chamadas, %llu commits, %llu bytes\n", c.updates,
+            c.commits, c.metadata_bytes);
+    fprintf(out, "Alocações: %llu, agrupamentos percorridos: %llu\n", c.allocations,
+            c.alloc_scanned);
+    fprintf(out, "Agrupamentos carregados: %llu, read-ahead: %llu\n", c.cluster_loads,
+            c.readahead_clusters);
+    fprintf(out, "Setores da FAT carregados sob demanda: %llu\n", c.fat_loads);
+    fprintf(out, "Nós de subdiretório lidos: %llu\n", c.node_loads);
+    fprintf(out, "Agrupamentos gravados comprimidos: %llu\n", c.compressed);
+    fprintf(out, "Cache: %llu acertos, %llu faltas, %llu expulsões\n", c.cache_hits,
+            c.cache_misses, c.cache_evictions);
+    fprintf(out, "operação\tchamadas\tmédia us\tp50 us\tp99 us\tp999 us\n");
+    for (i = 0; i < FS_NOPS; i++) {
+      h = &c.ops[i];
+      if (h->count)
+        fprintf(out, "%s\t\t%llu\t\t%.2f\t\t<%.3g\t<%.3g\t<%.3g\n", fs_op_name(i),
+                h->count, h->total_ns / 1e3 / h->count, hist_percentile(h, 0.5) / 1e3,
+                hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3);
+    }
+    return;
+  }
+
+  fprintf(out, "{\"sectors_read\": %llu, \"sectors_written\": %llu, "
+          "\"requests\": %llu, \"seeks\": %llu, \"syncs\": %llu,\n",
+          c.sectors_read, c.sectors_written, c.requests, c.seeks, c.syncs);
+  fprintf(out, " \"updates\": %llu, \"commits\": %llu, \"metadata_bytes\": %llu,\n",
+          c.updates, c.commits, c.metadata_bytes);
+  fprintf(out, " \"allocations\": %llu, \"alloc_scanned\": %llu, "
+          "\"cluster_loads\": %llu, \"readahead_clusters\": %llu, \"fat_loads\": %llu,\n",
+          c.allocations, c.alloc_scanned, c.cluster_loads, c.readahead_clusters, c.fat_loads);
+  fprintf(out, " \"node_loads\": %llu, \"compressed\": %llu,\n", c.node_loads, c.compressed);
+  fprintf(out, " \"cache_hits\": %llu, \"cache_misses\": %llu, \"cache_evictions\": %llu,\n",
+          c.cache_hits, c.cache_misses, c.cache_evictions);
+  fprintf(out, " \"ops\": {");
+  for (i = 0; i < FS_NOPS; i++) {
+    h = &c.ops[i];
+    fprintf(out, "%s\n  \"%s\": {\"count\": %llu, \"total_ns\": %llu, \"buckets_log2_ns\": [",
+            i ? "," : "", fs_op_name(i), h->count, h->total_ns);
+    for (b = 0; b < FS_HIST_BUCKETS; b++)
+      fprintf(out, "%s%llu", b ? ", " : "", h->buckets[b]);
+    fprintf(out, "]}");
+  }
+  fprintf(out, "\n }}\n");
+}
+
+/*  importdir/exportdir: uma thread lê os arquivos de origem em pedaços
+ *  grandes e a thread do shell os grava no destino, com NCHUNKS pedaços
+ *  circulando entre as duas */
+
+typedef struct {
+  char name[MAX_STR]; /*  Arquivo ao qual o pedaço pertence */
+  int dir; /*  Sem dados: só o diretório name a criar */
+  char *data;
+  int len;
+  int first, last; /*  Primeiro e último pedaço do arquivo */
+  int size; /*  Tamanho do arquivo, no primeiro pedaço */
+} chunk;
+
+chunk chunks[NCHUNKS];
+int chunk_head, chunk_count, chunk_done;
+pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t chunk_cond = PTHREAD_COND_INITIALIZER;
+
+/*  Pedaço livre para o leitor preencher */
+chunk *chunk_free() {
+  chunk *c;
+
+  pthread_mutex_lock(&chunk_lock);
+  while (chunk_count == NCHUNKS)
+    pthread_cond_wait(&chunk_cond, &chunk_lock);
+  c = &chunks[(chunk_head + chunk_count) % NCHUNKS];
+  pthread_mutex_unlock(&chunk_lock);
+  return c;
+}
+
+void chunk_publish(int done) {
+  pthread_mutex_lock(&chunk_lock);
+  if (done)
+    chunk_done = 1;
+  else
+    chunk_count++;
+  pthread_cond_broadcast(&chunk_cond);
+  pthread_mutex_unlock(&chunk_lock);
+}
+
+/*  Próximo pedaço para o gravador, ou NULL quando o leitor terminou */
+chunk *chunk_next() {
+  chunk *c = NULL;
+
+  pthread_mutex_lock(&chunk_lock);
+  while (!chunk_count && !chunk_done)
+    pthread_cond_wait(&chunk_cond, &chunk_lock);
+  if (chunk_count)
+    c = &chunks[chunk_head];
+  pthread_mutex_unlock(&chunk_lock);
+  return c;
+}
+
+void chunk_release() {
+  pthread_mutex_lock(&chunk_lock);
+  chunk_head = (chunk_head + 1) % NCHUNKS;
+  chunk_count--;
+  pthread_cond_broadcast(&chunk_cond);
+  pthread_mutex_unlock(&chunk_lock);
+}
+
+/*  Roda reader em uma thread e devolve 0 se não há memória para os
+ *  pedaços */
+int pipeline_start(pthread_t *thread, void *(*reader)(void *), void *arg) {
+  int i;
+
+  chunk_head = chunk_count = chunk_done = 0;
+  for (i = 0; i < NCHUNKS; i++) {
+    if ((chunks[i].data = malloc(CHUNK_SIZE)) == NULL) {
+      printf("Memória insuficiente para a cópia.\n");
+      while (i--)
+        free(chunks[i].data);
+      return 0;
+    }
+  }
+  if (pthread_create(thread, NULL, reader, arg)) {
+    printf("Erro criando a thread de leitura.\n");
+    for (i = 0; i < NCHUNKS; i++)
+      free(chunks[i].data);
+    return 0;
+  }
+  return 1;
+}
+
+void pipeline_end(pthread_t thread) {
+  int i;
+
+  pthread_join(thread, NULL);
+  for (i = 0; i < NCHUNKS; i++)
+    free(chunks[i].data);
+}
+
+void *import_reader(void *arg) {
+  char *dir = arg, path[2 * MAX_STR];
+  struct dirent *entry;
+  struct stat st;
+  DIR *d;
+  FILE *stream;
+  chunk *c;
+  int first;
+
+  if ((d = opendir(dir)) == NULL) {
+    perror("Abrindo diretório real");
+    chunk_publish(1);
+    return NULL;
+  }
+  while ((entry = readdir(d)) != NULL) {
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+      continue;
+    if ((stream = fopen(path, "r")) == NULL) {
+      perror(path);
+      continue;
+    }
+    first = 1;
+    do {
+      c = chunk_free();
+      strcpy(c->name, entry->d_name);
+      c->dir = 0;
+      c->size = st.st_size;
+      c->first = first;
+      c->len = fread(c->data, 1, CHUNK_SIZE, stream);
+      c->last = c->len < CHUNK_SIZE;
+      first = 0;
+      chunk_publish(0);
+    } while (!c->last);
+    fclose(stream);
+  }
+  closedir(d);
+  chunk_publish(1);
+  return NULL;
+}
+
+/*  Copia os arquivos regulares de um diretório real para o disco, com um
+ *  único commit de metadados no fim */
+void importdir(char *dir) {
+  pthread_t thread;
+  chunk *c;
+  int fd = -1, files = 0;
+
+  if (!pipeline_start(&thread, import_reader, dir))
+    return;
+  fs_batch(1);
+  while ((c = chunk_next()) != NULL) {
+    if (c->first && (fd = fs_open(c->name, FS_W)) != -1)
+      fs_fallocate(fd, c->size);
+    if (fd != -1 && c->len && fs_write(c->data, c->len, fd) != c->len) {
+      fs_close(fd);
+      fd = -1;
+    }
+    if (c->last && fd != -1) {
+      fs_close(fd);
+      fd = -1;
+      files++;
+    }
+    chunk_release();
+  }
+  fs_batch(0);
+  pipeline_end(thread);
+  printf("%d arquivos importados.\n", files);
+}
+
+/*  Publica os arquivos do diretório path do disco, com caminhos
+ *  relativos a partir de "", e desce nos subdiretórios depois de
+ *  publicar cada um */
+void export_tree(char *path) {
+  char name[FS_NAMESIZE], sub[MAX_STR];
+  rsfs_dir_t *d;
+  chunk *c;
+  int size, type, fd, first;
+
+  if ((d = fs_opendir(*path ? path : "/")) == NULL) {
+    printf("Não foi possível exportar %s.\n", path);
+    return;
+  }
+  while (fs_dirnext(d, name, &size, &type)) {
+    if (snprintf(sub, sizeof(sub), "%s%s%s", path, *path ? "/" : "", name) >= sizeof(sub)) {
+      printf("Caminho longo demais, não exportado: %s/%s\n", path, name);
+      continue;
+    }
+    if (type == FS_DIR) {
+      c = chunk_free();
+      strcpy(c->name, sub);
+      c->dir = 1;
+      c->first = c->last = 0;
+      c->len = 0;
+      chunk_publish(0);
+      export_tree(sub);
+      continue;
+    }
+    if ((fd = fs_open(sub, FS_R)) == -1) {
+      printf("Não foi possível exportar %s.\n", sub);
+      continue;
+    }
+    first = 1;
+    do {
+      c = chunk_free();
+      strcpy(c->name, sub);
+      c->dir = 0;
+      c->size = size;
+      c->first = first;
+      c->len = fs_read(c->data, CHUNK_SIZE, fd);
+      c->last = c->len < CHUNK_SIZE;
+      first = 0;
+      chunk_publish(0);
+    } while (!c->last);
+    fs_close(fd);
+  }
+  fs_closedir(d);
+}
+
+void *export_reader(void *arg) {
+  export_tree("");
+  chunk_publish(1);
+  return NULL;
+}
+
+/*  Copia todos os arquivos do disco para um diretório real existente,
+ *  recriando nele os subdiretórios */
+void exportdir(char *dir) {
+  char path[2 * MAX_STR];
+  pthread_t thread;
+  FILE *stream = NULL;
+  chunk *c;
+  int files = 0;
+
+  if (!pipeline_start(&thread, export_reader, NULL))
+    return;
+  while ((c = chunk_next()) != NULL) {
+    if (c->dir) {
+      snprintf(path, sizeof(path), "%s/%s", dir, c->name);
+      if (mkdir(path, 0777) == -1 && errno != EEXIST)
+        perror(path);
+      chunk_release();
+      continue;
+    }
+    if (c->first) {
+      snprintf(path, sizeof(path), "%s/%s", dir, c->name);
+      if ((stream = fopen(path, "w")) == NULL)
+        perror(path);
+    }
+    if (stream != NULL && fwrite(c->data, 1, c->len, stream) != c->len) {
+      perror("Escrevendo arquivo real");
+      fclose(stream);
+      stream = NULL;
+    }
+    if (c->last && stream != NULL) {
+      fclose(stream);
+      stream = NULL;
+      files++;
+    }
+    chunk_release();
+  }
+  pipeline_end(thread);
+  printf("%d arquivos exportados.\n", files);
+}